@@ -0,0 +1,309 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Shortest round-trip formatting of doubles with the Grisu2 algorithm.
+// See: F. Loitsch, "Printing floating-point numbers quickly and accurately with integers", PLDI 2010.
+//
+// The digits are generated with 64-bit integer arithmetic from a cached power of ten, so that no
+// "printf" is involved. The output is always read back as the same double, and is the shortest
+// representation in almost all cases (Grisu2 may emit one more digit for a tiny fraction of values).
+
+namespace dtoa_detail {
+
+//! Floating-point number "f * 2^e" with a 64-bit significand
+struct DiyFp {
+    uint64_t f;
+    int e;
+
+    DiyFp()
+        : f(0)
+        , e(0) {
+    }
+
+    DiyFp(uint64_t f, int e)
+        : f(f)
+        , e(e) {
+    }
+
+    explicit DiyFp(double d) {
+        uint64_t u;
+        std::memcpy(&u, &d, sizeof(double));
+        const int biased = (int)((u >> 52) & 0x7ff);
+        const uint64_t significand = u & ((1ull << 52) - 1);
+        if (biased != 0) {
+            f = significand + (1ull << 52);
+            e = biased - 1075;
+        } else {
+            f = significand;
+            e = -1074;
+        }
+    }
+
+    DiyFp operator-(const DiyFp &other) const {
+        return DiyFp(f - other.f, e);
+    }
+
+    //! Upper 64 bits of the 128-bit product (rounded)
+    DiyFp operator*(const DiyFp &other) const {
+        const uint64_t m32 = 0xffffffffull;
+        const uint64_t a = f >> 32, b = f & m32;
+        const uint64_t c = other.f >> 32, d = other.f & m32;
+        const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+        uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+        tmp += 1ull << 31;
+        return DiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), e + other.e + 64);
+    }
+
+    DiyFp normalize() const {
+        DiyFp res = *this;
+        while (!(res.f & (1ull << 63))) {
+            res.f <<= 1;
+            res.e--;
+        }
+        return res;
+    }
+
+    //! Boundaries "m-" and "m+" of the rounding interval, normalized to the same exponent
+    void normalizedBoundaries(DiyFp *minus, DiyFp *plus) const {
+        DiyFp pl(f * 2 + 1, e - 1);
+        pl = pl.normalize();
+        DiyFp mi = f == (1ull << 52) ? DiyFp(f * 4 - 1, e - 2) : DiyFp(f * 2 - 1, e - 1);
+        mi.f <<= mi.e - pl.e;
+        mi.e = pl.e;
+        *plus = pl;
+        *minus = mi;
+    }
+};
+
+//! Normalized powers of ten "10^k" for k = -348, -340, ..., 340, which are rounded to 64 bits.
+//! They are computed once with big integers instead of being listed as literals.
+inline const std::vector<DiyFp> &cachedPowers() {
+    static const std::vector<DiyFp> powers = []() {
+        std::vector<DiyFp> table;
+        for (int k = -348; k <= 340; k += 8) {
+            // 2^P * 10^k as a big integer with 32-bit limbs (the division by ten is floored)
+            const int P = 96 + (k < 0 ? (int)std::ceil(-k * 3.3219280948873623) : 0);
+            std::vector<uint32_t> big(P / 32 + 1, 0);
+            big[P / 32] = 1u << (P % 32);
+            for (int i = 0; i < std::abs(k); i++) {
+                uint64_t carry = 0;
+                if (k > 0) {
+                    for (auto &limb : big) {
+                        const uint64_t v = (uint64_t)limb * 10 + carry;
+                        limb = (uint32_t)v;
+                        carry = v >> 32;
+                    }
+                    if (carry) {
+                        big.push_back((uint32_t)carry);
+                    }
+                } else {
+                    for (size_t j = big.size(); j-- > 0;) {
+                        const uint64_t v = (carry << 32) | big[j];
+                        big[j] = (uint32_t)(v / 10);
+                        carry = v % 10;
+                    }
+                }
+                while (big.size() > 1 && big.back() == 0) {
+                    big.pop_back();
+                }
+            }
+
+            // Top 64 bits rounded to nearest
+            int nBits = (int)(big.size() - 1) * 32;
+            for (uint32_t top = big.back(); top != 0; top >>= 1) {
+                nBits++;
+            }
+            const auto bit = [&](int i) -> uint64_t { return (big[i / 32] >> (i % 32)) & 1; };
+            uint64_t f = 0;
+            for (int i = nBits - 1; i >= nBits - 64; i--) {
+                f = (f << 1) | bit(i);
+            }
+            int e = nBits - 64 - P;
+            if (bit(nBits - 65)) {
+                f++;
+                if (f == 0) {
+                    f = 1ull << 63;
+                    e++;
+                }
+            }
+            table.emplace_back(f, e);
+        }
+        return table;
+    }();
+    return powers;
+}
+
+//! Cached power "c = 10^(-K)" such that the exponent of "w * c" is in [-60, -32] for the exponent "e" of "w"
+inline DiyFp getCachedPower(int e, int *K) {
+    const double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (k != dk) {
+        k++;
+    }
+    const int index = (k >> 3) + 1;
+    *K = -(-348 + index * 8);
+    return cachedPowers()[index];
+}
+
+inline void grisuRound(char *buffer, int len, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t wpw) {
+    while (rest < wpw && delta - rest >= tenKappa &&
+           (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw)) {
+        buffer[len - 1]--;
+        rest += tenKappa;
+    }
+}
+
+inline int countDecimalDigits(uint32_t n) {
+    int count = 1;
+    while (n >= 10) {
+        n /= 10;
+        count++;
+    }
+    return count;
+}
+
+//! Generate the shortest digits in the interval (Mp - delta, Mp] close to W
+inline void digitGen(const DiyFp &W, const DiyFp &Mp, uint64_t delta, char *buffer, int *len, int *K) {
+    static const uint64_t pow10[] = {
+        1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+        10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+        1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+        10000000000000000000ull
+    };
+    const DiyFp one(1ull << -Mp.e, Mp.e);
+    const DiyFp wpw = Mp - W;
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = countDecimalDigits(p1);
+    *len = 0;
+
+    // Integer part
+    while (kappa > 0) {
+        const uint32_t div = (uint32_t)pow10[kappa - 1];
+        const uint32_t d = p1 / div;
+        p1 %= div;
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+        const uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            grisuRound(buffer, *len, delta, rest, pow10[kappa] << -one.e, wpw.f);
+            return;
+        }
+    }
+
+    // Fractional part
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        const char d = (char)(p2 >> -one.e);
+        if (d || *len) {
+            buffer[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            const int index = -kappa;
+            grisuRound(buffer, *len, delta, p2, one.f, wpw.f * (index < 20 ? pow10[index] : 0));
+            return;
+        }
+    }
+}
+
+//! Digits of a positive finite double, whose value is "buffer * 10^K"
+inline void grisu2(double value, char *buffer, int *len, int *K) {
+    const DiyFp v(value);
+    DiyFp wm, wp;
+    v.normalizedBoundaries(&wm, &wp);
+
+    const DiyFp c = getCachedPower(wp.e, K);
+    const DiyFp W = v.normalize() * c;
+    DiyFp Wp = wp * c;
+    DiyFp Wm = wm * c;
+    Wm.f++;
+    Wp.f--;
+    digitGen(W, Wp, Wp.f - Wm.f, buffer, len, K);
+}
+
+inline int writeExponent(int k, char *buffer) {
+    int len = 0;
+    buffer[len++] = 'e';
+    buffer[len++] = k < 0 ? '-' : '+';
+    k = std::abs(k);
+    if (k >= 100) {
+        buffer[len++] = (char)('0' + k / 100);
+        k %= 100;
+        buffer[len++] = (char)('0' + k / 10);
+    } else if (k >= 10) {
+        buffer[len++] = (char)('0' + k / 10);
+    }
+    buffer[len++] = (char)('0' + k % 10);
+    return len;
+}
+
+//! Place the decimal point of the digits "buffer[0, len) * 10^k" (fixed or scientific notation)
+inline int prettify(char *buffer, int len, int k) {
+    const int kk = len + k;  // 10^(kk - 1) <= v < 10^kk
+    if (0 <= k && kk <= 21) {
+        // 1234e7 -> 12340000000
+        std::memset(buffer + len, '0', k);
+        return kk;
+    } else if (0 < kk && kk <= 21) {
+        // 1234e-2 -> 12.34
+        std::memmove(buffer + kk + 1, buffer + kk, len - kk);
+        buffer[kk] = '.';
+        return len + 1;
+    } else if (-6 < kk && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        const int offset = 2 - kk;
+        std::memmove(buffer + offset, buffer, len);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        std::memset(buffer + 2, '0', offset - 2);
+        return len + offset;
+    } else if (len == 1) {
+        // 1e30
+        return 1 + writeExponent(kk - 1, buffer + 1);
+    } else {
+        // 1234e30 -> 1.234e+33
+        std::memmove(buffer + 2, buffer + 1, len - 1);
+        buffer[1] = '.';
+        return len + 1 + writeExponent(kk - 1, buffer + len + 1);
+    }
+}
+
+}  // namespace dtoa_detail
+
+//! Write the shortest decimal representation of "value" which is read back as the same double
+//! (without the null terminator), and return its length. "buffer" must have 32 bytes at least.
+inline int format_double(double value, char *buffer) {
+    if (std::isnan(value)) {
+        std::memcpy(buffer, "nan", 3);
+        return 3;
+    }
+
+    int len = 0;
+    if (std::signbit(value)) {
+        buffer[len++] = '-';
+        value = -value;
+    }
+    if (std::isinf(value)) {
+        std::memcpy(buffer + len, "inf", 3);
+        return len + 3;
+    }
+    if (value == 0.0) {
+        buffer[len++] = '0';
+        return len;
+    }
+
+    int nDigits = 0, K = 0;
+    dtoa_detail::grisu2(value, buffer + len, &nDigits, &K);
+    return len + dtoa_detail::prettify(buffer + len, nDigits, K);
+}
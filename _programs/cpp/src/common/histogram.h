@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <climits>
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Histogram of 16-bit voxel values with one bin per value (including USHRT_MAX).
+//! Prefix sums are computed once, so that threshold queries only take O(#bins).
+class Histogram {
+public:
+    static constexpr int numBins = USHRT_MAX + 1;
+
+    Histogram() = default;
+
+    //! Build the histogram in a single parallel pass. Each thread fills its own bins,
+    //! and the bins are reduced in a fixed order, so the result is deterministic.
+    Histogram(const uint16_t *values, uint64_t count)
+        : counts(numBins, 0) {
+        #ifdef _OPENMP
+        const int nThreads = omp_get_max_threads();
+        #else
+        const int nThreads = 1;
+        #endif
+        std::vector<std::vector<uint64_t>> local(nThreads);
+
+        #ifdef _OPENMP
+        #pragma omp parallel num_threads(nThreads)
+        #endif
+        {
+            #ifdef _OPENMP
+            const int tid = omp_get_thread_num();
+            #else
+            const int tid = 0;
+            #endif
+            std::vector<uint64_t> &bins = local[tid];
+            bins.assign(numBins, 0);
+
+            #ifdef _OPENMP
+            #pragma omp for schedule(static)
+            #endif
+            for (int64_t i = 0; i < (int64_t)count; i++) {
+                bins[values[i]] += 1;
+            }
+        }
+
+        for (const auto &bins : local) {
+            for (int i = 0; i < numBins; i++) {
+                counts[i] += bins[i];
+            }
+        }
+
+        cumCounts.assign(numBins + 1, 0);
+        cumSums.assign(numBins + 1, 0);
+        for (int i = 0; i < numBins; i++) {
+            cumCounts[i + 1] = cumCounts[i] + counts[i];
+            cumSums[i + 1] = cumSums[i] + counts[i] * (uint64_t)i;
+        }
+    }
+
+    uint64_t operator[](int i) const {
+        return counts[i];
+    }
+
+    //! Number of values in the bins [begin, end)
+    uint64_t count(int begin, int end) const {
+        return cumCounts[end] - cumCounts[begin];
+    }
+
+    uint64_t total() const {
+        return cumCounts.empty() ? 0 : cumCounts[numBins];
+    }
+
+    //! Sum of the values in the bins [begin, end)
+    uint64_t sum(int begin, int end) const {
+        return cumSums[end] - cumSums[begin];
+    }
+
+    //! Multi-level Otsu's method, which splits the non-zero voxels into "nClasses" classes
+    //! and returns "nClasses - 1" thresholds in ascending order. The optimal boundaries are found
+    //! by dynamic programming over "coarseBins" groups of bins, and each of them is then refined
+    //! over the full resolution with the others fixed.
+    std::vector<double> multiOtsuThresholds(int nClasses, int coarseBins = 256) const {
+        if (nClasses < 2) {
+            return {};
+        }
+
+        // Boundaries of the groups of bins over [1, numBins)
+        coarseBins = std::max(nClasses, std::min(coarseBins, numBins - 1));
+        std::vector<int> edges(coarseBins + 1);
+        for (int i = 0; i <= coarseBins; i++) {
+            edges[i] = 1 + (int)((int64_t)(numBins - 1) * i / coarseBins);
+        }
+
+        // score[k][j]: best sum of "w * mu^2" when the groups [0, j) are split into k + 1 classes
+        const double minusInf = -1.0;
+        std::vector<std::vector<double>> score(nClasses, std::vector<double>(coarseBins + 1, minusInf));
+        std::vector<std::vector<int>> from(nClasses, std::vector<int>(coarseBins + 1, 0));
+        for (int j = 1; j <= coarseBins; j++) {
+            score[0][j] = classScore(edges[0], edges[j]);
+        }
+        for (int k = 1; k < nClasses; k++) {
+            for (int j = k + 1; j <= coarseBins; j++) {
+                for (int i = k; i < j; i++) {
+                    if (score[k - 1][i] < 0.0) {
+                        continue;
+                    }
+                    const double value = score[k - 1][i] + classScore(edges[i], edges[j]);
+                    if (score[k][j] < value) {
+                        score[k][j] = value;
+                        from[k][j] = i;
+                    }
+                }
+            }
+        }
+
+        std::vector<int> bounds(nClasses + 1);
+        bounds[0] = 1;
+        bounds[nClasses] = numBins;
+        for (int k = nClasses - 1, j = coarseBins; k > 0; k--) {
+            j = from[k][j];
+            bounds[k] = edges[j];
+        }
+
+        // Refine each boundary between its neighbors at full resolution
+        for (int k = 1; k < nClasses; k++) {
+            double best = classScore(bounds[k - 1], bounds[k]) + classScore(bounds[k], bounds[k + 1]);
+            for (int t = bounds[k - 1] + 1; t < bounds[k + 1]; t++) {
+                const double value = classScore(bounds[k - 1], t) + classScore(t, bounds[k + 1]);
+                if (best < value) {
+                    best = value;
+                    bounds[k] = t;
+                }
+            }
+        }
+
+        std::vector<double> thresholds;
+        for (int k = 1; k < nClasses; k++) {
+            thresholds.push_back(bounds[k] / (double)USHRT_MAX);
+        }
+        return thresholds;
+    }
+
+private:
+    //! Contribution "w * mu^2 = s^2 / w" of the class [begin, end) to the between-class variance
+    double classScore(int begin, int end) const {
+        const double c = (double)count(begin, end);
+        const double s = (double)sum(begin, end);
+        return c != 0.0 ? s * s / c : 0.0;
+    }
+
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> cumCounts;
+    std::vector<uint64_t> cumSums;
+};
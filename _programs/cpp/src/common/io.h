@@ -1,154 +1,736 @@
 #pragma once
 
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "vec3.h"
+#include "dtoa.h"
+#include "mmap.h"
 
-//! Write OBJ file
-inline void write_obj(const std::string &filename, const std::vector<Vec3> &positions,
-                      const std::vector<uint32_t> &indices) {
-    std::ofstream writer(filename.c_str(), std::ios::out);
-    if (writer.fail()) {
-        throw std::runtime_error("Failed to open file: " + filename);
+namespace io_detail {
+
+inline int formatUint(uint64_t v, char *buf) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    for (int i = 0; i < n; i++) {
+        buf[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+//! Format the items [0, count) with "format(i, &text)" in chunks of "chunkSize" items, and write the chunks in
+//! order. Chunks are formatted in parallel by rounds of a few chunks per thread, so that the output does not
+//! depend on the number of threads, and only the text of one round is held in memory.
+template <typename Format>
+void writeChunks(std::ostream &writer, size_t count, Format format, size_t chunkSize = 1 << 16) {
+    #ifdef _OPENMP
+    const size_t nThreads = omp_get_max_threads();
+    #else
+    const size_t nThreads = 1;
+    #endif
+    const size_t nChunks = (count + chunkSize - 1) / chunkSize;
+    std::vector<std::string> texts(std::min(nChunks, nThreads * 4));
+    for (size_t first = 0; first < nChunks; first += texts.size()) {
+        const size_t last = std::min(nChunks, first + texts.size());
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+        #endif
+        for (int64_t c = first; c < (int64_t)last; c++) {
+            std::string &text = texts[c - first];
+            text.clear();
+            const size_t end = std::min(count, (c + 1) * chunkSize);
+            for (size_t i = c * chunkSize; i < end; i++) {
+                format(i, &text);
+            }
+        }
+
+        for (size_t c = first; c < last; c++) {
+            writer.write(texts[c - first].data(), texts[c - first].size());
+        }
     }
+}
 
-    for (const auto &p : positions) {
-        writer << "v " << p.x << " " << p.y << " " << p.z << "\n";
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+//! Parse a number after optional blanks in [p, end), and return the pointer past it (or nullptr if there is none).
+//! Numbers with at most 19 significant digits, whose mantissa is exact in a double and whose decimal exponent is
+//! in [-22, 22], are converted exactly with a single multiplication or division. Others go to "strtod".
+inline const char *parseDouble(const char *p, const char *end, double *value) {
+    static const double pow10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    while (p < end && isBlank(*p)) {
+        p++;
     }
+    const char *start = p;
 
-    const int nFaces = (int)indices.size() / 3;
-    for (int i = 0; i < nFaces; i++) {
-        const uint32_t a = indices[i * 3 + 0] + 1;
-        const uint32_t b = indices[i * 3 + 1] + 1;
-        const uint32_t c = indices[i * 3 + 2] + 1;
-        writer << "f " << a << " " << b << " " << c << "\n";
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
     }
 
-    writer.close();
+    uint64_t mantissa = 0;
+    int nDigits = 0, exponent = 0;
+    bool exact = true, any = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+        if (nDigits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            nDigits += mantissa != 0;
+        } else {
+            exponent++;
+            exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+            if (nDigits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                nDigits += mantissa != 0;
+                exponent--;
+            } else {
+                exact = false;
+            }
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExp = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negativeExp = *q == '-';
+            q++;
+        }
+        int e = 0;
+        bool anyExp = false;
+        for (; q < end && *q >= '0' && *q <= '9'; q++, anyExp = true) {
+            e = std::min(e * 10 + (*q - '0'), 100000);
+        }
+        if (anyExp) {
+            exponent += negativeExp ? -e : e;
+            p = q;
+        }
+    }
+
+    if (any && exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        const double v = (double)mantissa;
+        *value = exponent < 0 ? v / pow10[-exponent] : v * pow10[exponent];
+        *value = negative ? -*value : *value;
+        return p;
+    }
+
+    // Slow path for long mantissas, large exponents, and "nan" or "inf"
+    while (p < end && !isBlank(*p) && *p != '\n') {
+        p++;
+    }
+    char buf[128];
+    const size_t len = std::min((size_t)(p - start), sizeof(buf) - 1);
+    std::memcpy(buf, start, len);
+    buf[len] = '\0';
+    char *last = nullptr;
+    *value = std::strtod(buf, &last);
+    return last != buf ? p : nullptr;
 }
 
-//! Write PLY file
-inline void write_ply(const std::string &filename, const std::vector<Vec3> &positions,
+}  // namespace io_detail
+
+//! Write OBJ file. Numbers are written with the shortest representations which are read back exactly.
+inline void write_obj(const std::string &filename, const std::vector<Vec3> &positions,
                       const std::vector<uint32_t> &indices) {
     std::ofstream writer(filename.c_str(), std::ios::out | std::ios::binary);
     if (writer.fail()) {
         throw std::runtime_error("Failed to open file: " + filename);
     }
 
-    writer << "ply"
-           << "\n";
-    writer << "format binary_little_endian 1.0"
-           << "\n";
+    io_detail::writeChunks(writer, positions.size(), [&](size_t i, std::string *text) {
+        char buf[128];
+        int len = 0;
+        buf[len++] = 'v';
+        for (int k = 0; k < 3; k++) {
+            buf[len++] = ' ';
+            len += format_double(positions[i][k], buf + len);
+        }
+        buf[len++] = '\n';
+        text->append(buf, len);
+    });
 
-    const size_t nVerts = positions.size();
-    writer << "element vertex " << nVerts << "\n";
-    writer << "property float x"
-           << "\n";
-    writer << "property float y"
-           << "\n";
-    writer << "property float z"
-           << "\n";
+    io_detail::writeChunks(writer, indices.size() / 3, [&](size_t i, std::string *text) {
+        char buf[128];
+        int len = 0;
+        buf[len++] = 'f';
+        for (int k = 0; k < 3; k++) {
+            buf[len++] = ' ';
+            len += io_detail::formatUint((uint64_t)indices[i * 3 + k] + 1, buf + len);
+        }
+        buf[len++] = '\n';
+        text->append(buf, len);
+    });
+
+    writer.close();
+}
+
+//! Receiver of the meshes produced by the extractors. Vertices and faces are passed in batches, and the faces
+//! refer to the vertices by their indices in the order of all the vertices passed so far.
+class MeshSink {
+public:
+    virtual ~MeshSink() = default;
+    virtual void addVertices(const Vec3 *positions, size_t count) = 0;
+    virtual void addFaces(const uint32_t *indices, size_t nIndices) = 0;
+};
+
+//! Streaming writer of binary PLY files, which accepts vertices and faces in any order while the mesh is
+//! being produced. The header reserves fixed-width element counts, which are patched when the file is closed.
+//! Vertices are written to the file through a buffer. Faces are kept in another buffer, which is spilled
+//! to a temporary file "<filename>.faces" when it is full, and appended to the file after all the vertices.
+//! The buffers grow on demand up to "bufferSize" bytes, so that small meshes do not allocate all of it.
+//! When no more vertices will be added, "finishVertices" lets the following faces go directly to the file.
+class PlyStreamWriter : public MeshSink {
+public:
+    explicit PlyStreamWriter(const std::string &filename, size_t bufferSize = 32 << 20)
+        : filename(filename)
+        , spillname(filename + ".faces")
+        , capacity(std::max(bufferSize, (size_t)faceBytes)) {
+        writer.open(filename.c_str(), std::ios::out | std::ios::binary);
+        if (writer.fail()) {
+            throw std::runtime_error("Failed to open file: " + filename);
+        }
+
+        // Counts are zero-padded, so that they can be overwritten in place
+        writer << "ply\n";
+        writer << "format binary_little_endian 1.0\n";
+        writer << "element vertex ";
+        vertexCountPos = writer.tellp();
+        writer << formatCount(0) << "\n";
+        writer << "property float x\n";
+        writer << "property float y\n";
+        writer << "property float z\n";
+        writer << "element face ";
+        faceCountPos = writer.tellp();
+        writer << formatCount(0) << "\n";
+        writer << "property list uchar int vertex_indices\n";
+        writer << "end_header\n";
+    }
+
+    PlyStreamWriter(const PlyStreamWriter &) = delete;
+    PlyStreamWriter &operator=(const PlyStreamWriter &) = delete;
+
+    ~PlyStreamWriter() override {
+        try {
+            close();
+        } catch (const std::exception &e) {
+            fprintf(stderr, "%s\n", e.what());
+        }
+    }
+
+    void addVertices(const Vec3 *positions, size_t count) override {
+        if (verticesFinished) {
+            throw std::runtime_error("Vertices are added after the faces are written: " + filename);
+        }
+        if (nVerts + count > UINT32_MAX) {
+            throw std::runtime_error("Too many vertices for PLY file: " + filename);
+        }
+
+        for (size_t i = 0; i < count;) {
+            if (vertexBuffer.size() + vertexBytes > capacity) {
+                flushVertices();
+            }
+            const size_t n = std::min(count - i, (capacity - vertexBuffer.size()) / vertexBytes);
+            const size_t offset = vertexBuffer.size();
+            grow(&vertexBuffer, offset + n * vertexBytes);
+            char *dst = vertexBuffer.data() + offset;
+            for (size_t j = 0; j < n; j++, i++) {
+                const float buf[3] = { (float)positions[i].x, (float)positions[i].y, (float)positions[i].z };
+                std::memcpy(dst + j * vertexBytes, buf, vertexBytes);
+            }
+        }
+        nVerts += count;
+    }
+
+    void addFaces(const uint32_t *indices, size_t nIndices) override {
+        const size_t count = nIndices / 3;
+        for (size_t i = 0; i < count;) {
+            if (faceBuffer.size() + faceBytes > capacity) {
+                if (verticesFinished) {
+                    flushFaces();
+                } else {
+                    spillFaces();
+                }
+            }
+            const size_t n = std::min(count - i, (capacity - faceBuffer.size()) / faceBytes);
+            const size_t offset = faceBuffer.size();
+            grow(&faceBuffer, offset + n * faceBytes);
+            char *dst = faceBuffer.data() + offset;
+            for (size_t j = 0; j < n; j++, i++) {
+                dst[j * faceBytes] = 3;
+                std::memcpy(dst + j * faceBytes + 1, indices + i * 3, sizeof(uint32_t) * 3);
+            }
+        }
+        nFaces += count;
+    }
+
+    size_t vertexCount() const {
+        return nVerts;
+    }
+
+    size_t faceCount() const {
+        return nFaces;
+    }
+
+    //! Write the vertices and the faces so far. The faces added after this are written without spilling.
+    void finishVertices() {
+        if (verticesFinished) {
+            return;
+        }
+
+        flushVertices();
+        if (spill.is_open()) {
+            spillFaces();
+            spill.close();
+
+            std::ifstream reader(spillname.c_str(), std::ios::in | std::ios::binary);
+            if (reader.fail()) {
+                throw std::runtime_error("Failed to open file: " + spillname);
+            }
+            faceBuffer.resize(capacity);
+            while (reader.read(faceBuffer.data(), capacity) || reader.gcount() > 0) {
+                writer.write(faceBuffer.data(), reader.gcount());
+            }
+            reader.close();
+            std::remove(spillname.c_str());
+            faceBuffer.clear();
+        }
+        flushFaces();
+        verticesFinished = true;
+    }
+
+    //! Write the faces after the vertices, and patch the counts in the header
+    void close() {
+        if (!writer.is_open()) {
+            return;
+        }
 
-    const int nFaces = (int)indices.size() / 3;
-    writer << "element face " << nFaces << "\n";
-    writer << "property list uchar int vertex_indices"
-           << "\n";
-    writer << "end_header"
-           << "\n";
+        finishVertices();
+        flushFaces();
+        std::vector<char>().swap(faceBuffer);
+        std::vector<char>().swap(vertexBuffer);
 
-    for (const auto &p : positions) {
-        float buf[3] = { (float)p.x, (float)p.y, (float)p.z };
-        writer.write((char *)buf, sizeof(float) * 3);
+        writer.seekp(vertexCountPos);
+        writer << formatCount(nVerts);
+        writer.seekp(faceCountPos);
+        writer << formatCount(nFaces);
+        writer.close();
+        if (writer.fail()) {
+            throw std::runtime_error("Failed to write file: " + filename);
+        }
+    }
+
+private:
+    static constexpr size_t vertexBytes = sizeof(float) * 3;
+    static constexpr size_t faceBytes = sizeof(uint8_t) + sizeof(uint32_t) * 3;
+
+    static std::string formatCount(size_t count) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%010llu", (unsigned long long)count);
+        return buf;
+    }
+
+    //! Resize "buffer", whose allocation is doubled as needed but does not exceed "capacity"
+    void grow(std::vector<char> *buffer, size_t size) const {
+        if (size > buffer->capacity()) {
+            buffer->reserve(std::min(capacity, std::max(size, buffer->capacity() * 2)));
+        }
+        buffer->resize(size);
+    }
+
+    void flushVertices() {
+        writer.write(vertexBuffer.data(), vertexBuffer.size());
+        vertexBuffer.clear();
     }
 
-    for (int i = 0; i < nFaces; i++) {
-        const uint8_t k = 3;
-        writer.write((char *)&k, sizeof(uint8_t));
+    void flushFaces() {
+        writer.write(faceBuffer.data(), faceBuffer.size());
+        faceBuffer.clear();
+    }
 
-        const uint32_t a = indices[i * 3 + 0];
-        const uint32_t b = indices[i * 3 + 1];
-        const uint32_t c = indices[i * 3 + 2];
-        uint32_t buf[3] = { a, b, c };
-        writer.write((char *)buf, sizeof(uint32_t) * 3);
+    void spillFaces() {
+        if (!spill.is_open()) {
+            spill.open(spillname.c_str(), std::ios::out | std::ios::binary);
+            if (spill.fail()) {
+                throw std::runtime_error("Failed to open file: " + spillname);
+            }
+        }
+        spill.write(faceBuffer.data(), faceBuffer.size());
+        faceBuffer.clear();
     }
 
+    std::string filename, spillname;
+    std::ofstream writer, spill;
+    std::streampos vertexCountPos, faceCountPos;
+    size_t capacity;
+    std::vector<char> vertexBuffer, faceBuffer;
+    size_t nVerts = 0, nFaces = 0;
+    bool verticesFinished = false;
+};
+
+//! Write PLY file
+inline void write_ply(const std::string &filename, const std::vector<Vec3> &positions,
+                      const std::vector<uint32_t> &indices) {
+    PlyStreamWriter writer(filename);
+    writer.addVertices(positions.data(), positions.size());
+    writer.finishVertices();
+    writer.addFaces(indices.data(), indices.size());
     writer.close();
 }
 
-// Load OFF mesh file (in this program, the file stores only point cloud)
+// Load OFF mesh file (in this program, the file stores only point cloud). The file is memory-mapped, the arrays
+// are sized from the counts in the header, and the lines are parsed in parallel by chunks split at line breaks.
 inline void read_off(const std::string &filename, std::vector<Vec3> *positions, std::vector<Vec3> *normals = nullptr) {
-    std::ifstream reader(filename.c_str(), std::ios::in);
-    if (reader.fail()) {
-        throw std::runtime_error("Failed to open file: " + filename);
-    }
+    const MappedFile file(filename);
+    const char *p = file.data();
+    const char *end = p + file.size();
 
-    std::string line;
-    std::stringstream ss;
+    // Next line which is neither blank nor a comment
+    const auto nextLine = [&](const char **begin, const char **last) -> bool {
+        while (p < end) {
+            const char *lineEnd = (const char *)std::memchr(p, '\n', end - p);
+            lineEnd = lineEnd != nullptr ? lineEnd : end;
+            const char *q = p;
+            while (q < lineEnd && io_detail::isBlank(*q)) {
+                q++;
+            }
+            *begin = q;
+            *last = lineEnd;
+            p = lineEnd < end ? lineEnd + 1 : end;
+            if (q < lineEnd && *q != '#') {
+                return true;
+            }
+        }
+        return false;
+    };
 
     // Magic word
-    std::getline(reader, line);
-    if (line != "NOFF") {
+    const char *lineBegin = nullptr, *lineEnd = nullptr;
+    if (!nextLine(&lineBegin, &lineEnd)) {
+        throw std::runtime_error("Invalid OFF file!");
+    }
+    std::string magic(lineBegin, lineEnd);
+    magic.erase(magic.find_last_not_of(" \t\r") + 1);
+    const bool hasNormals = magic == "NOFF";
+    if (!hasNormals && (magic != "OFF" || normals != nullptr)) {
         throw std::runtime_error("Invalid OFF file!");
     }
 
     // Sizes
-    int nVerts, nFaces, nEdges;
-    std::getline(reader, line);
-    ss.clear();
-    ss << line;
-    ss >> nVerts >> nFaces >> nEdges;
-
-    // Positions
-    while (std::getline(reader, line)) {
-        ss.clear();
-        ss << line;
-        Vec3 v, n;
-        ss >> v.x >> v.y >> v.z >> n.x >> n.y >> n.z;
-        positions->push_back(v);
+    double counts[3] = { 0.0, 0.0, 0.0 };
+    if (!nextLine(&lineBegin, &lineEnd)) {
+        throw std::runtime_error("Invalid OFF file!");
+    }
+    for (int k = 0; k < 3 && lineBegin != nullptr; k++) {
+        lineBegin = io_detail::parseDouble(lineBegin, lineEnd, &counts[k]);
+    }
+    if (lineBegin == nullptr || !(counts[0] >= 0.0)) {
+        throw std::runtime_error("Invalid OFF file!");
+    }
+    const size_t nVerts = (size_t)counts[0];
+
+    // Split the rest at line breaks
+    #ifdef _OPENMP
+    const size_t nThreads = omp_get_max_threads();
+    #else
+    const size_t nThreads = 1;
+    #endif
+    const size_t nChunks = std::max((size_t)1, std::min(nThreads * 8, (size_t)(end - p) >> 20));
+    std::vector<const char *> bounds(nChunks + 1, end);
+    bounds[0] = p;
+    for (size_t c = 1; c < nChunks; c++) {
+        const char *q = std::max(bounds[c - 1], p + (end - p) * c / nChunks);
+        const char *lineBreak = (const char *)std::memchr(q, '\n', end - q);
+        bounds[c] = lineBreak != nullptr ? lineBreak + 1 : end;
+    }
+
+    // Count the lines of the chunks, so that each chunk knows where its points go
+    const auto isDataLine = [](const char *q, const char *lineEnd) -> bool {
+        while (q < lineEnd && io_detail::isBlank(*q)) {
+            q++;
+        }
+        return q < lineEnd && *q != '#';
+    };
+    const auto forEachLine = [&](size_t c, auto func) {
+        for (const char *q = bounds[c]; q < bounds[c + 1];) {
+            const char *lineBreak = (const char *)std::memchr(q, '\n', bounds[c + 1] - q);
+            const char *lineEnd = lineBreak != nullptr ? lineBreak : bounds[c + 1];
+            if (isDataLine(q, lineEnd)) {
+                func(q, lineEnd);
+            }
+            q = lineEnd + 1;
+        }
+    };
+
+    std::vector<size_t> offsets(nChunks + 1, 0);
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int64_t c = 0; c < (int64_t)nChunks; c++) {
+        size_t count = 0;
+        forEachLine(c, [&](const char *, const char *) { count++; });
+        offsets[c + 1] = count;
+    }
+    for (size_t c = 0; c < nChunks; c++) {
+        offsets[c + 1] += offsets[c];
+    }
+
+    // Positions (and normals). Lines after the points declared in the header are ignored, but a file with fewer
+    // lines (e.g., truncated one) is rejected.
+    if (offsets[nChunks] < nVerts) {
+        throw std::runtime_error("Invalid OFF file!");
+    }
+    const size_t nPoints = nVerts;
+    const size_t base = positions->size();
+    positions->resize(base + nPoints);
+    if (normals) {
+        normals->resize(base + nPoints);
+    }
+
+    bool valid = true;
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) reduction(&& : valid)
+    #endif
+    for (int64_t c = 0; c < (int64_t)nChunks; c++) {
+        size_t i = offsets[c];
+        forEachLine(c, [&](const char *q, const char *lineEnd) {
+            if (i >= nPoints) {
+                return;
+            }
+            double v[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+            for (int k = 0; k < (hasNormals ? 6 : 3) && q != nullptr; k++) {
+                q = io_detail::parseDouble(q, lineEnd, &v[k]);
+            }
+            valid = valid && q != nullptr;
+            (*positions)[base + i] = Vec3(v[0], v[1], v[2]);
+            if (normals) {
+                (*normals)[base + i] = Vec3(v[3], v[4], v[5]);
+            }
+            i++;
+        });
+    }
+    if (!valid) {
+        throw std::runtime_error("Invalid OFF file!");
+    }
+}
+
+// Load binary little-endian PLY file with the vertex properties "x", "y", "z" (and "nx", "ny", "nz" if normals
+// are requested) in float or double. The file is memory-mapped and the vertices are copied to the arrays in
+// parallel. Other vertex properties and the elements after the vertices (e.g., faces) are ignored.
+inline void read_ply(const std::string &filename, std::vector<Vec3> *positions, std::vector<Vec3> *normals = nullptr) {
+    const MappedFile file(filename);
+    const char *p = file.data();
+    const char *end = p + file.size();
+
+    // Header
+    struct Property {
+        std::string name;
+        int size;
+        size_t offset;
+    };
+    std::vector<Property> properties;
+    size_t nVerts = 0, nElements = 0, skipBytes = 0, stride = 0;
+    bool inVertex = false, afterVertex = false, binary = false, hasHeaderEnd = false;
+    int lineNo = 0;
+    while (p < end) {
+        const char *lineBreak = (const char *)std::memchr(p, '\n', end - p);
+        const char *lineEnd = lineBreak != nullptr ? lineBreak : end;
+        std::istringstream iss(std::string(p, lineEnd));
+        p = lineEnd < end ? lineEnd + 1 : end;
+
+        std::string keyword;
+        iss >> keyword;
+        if (lineNo++ == 0) {
+            if (keyword != "ply") {
+                throw std::runtime_error("Invalid PLY file: " + filename);
+            }
+        } else if (keyword == "format") {
+            std::string format;
+            iss >> format;
+            binary = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            std::string name;
+            size_t count = 0;
+            iss >> name >> count;
+            afterVertex = afterVertex || inVertex;
+            inVertex = name == "vertex";
+            nElements = count;
+            if (inVertex) {
+                nVerts = count;
+            }
+        } else if (keyword == "property") {
+            std::string type, name;
+            iss >> type;
+            if (type == "list") {
+                if (!afterVertex) {
+                    throw std::runtime_error("List properties before/in vertices are not supported: " + filename);
+                }
+                continue;
+            }
+            iss >> name;
+
+            int size = 0;
+            if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") {
+                size = 1;
+            } else if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") {
+                size = 2;
+            } else if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" ||
+                       type == "float32") {
+                size = 4;
+            } else if (type == "double" || type == "float64") {
+                size = 8;
+            } else {
+                throw std::runtime_error("Unknown PLY property type \"" + type + "\": " + filename);
+            }
+
+            if (inVertex) {
+                properties.push_back({ name, size, stride });
+                stride += size;
+            } else if (!afterVertex) {
+                // Fixed-size elements before the vertices are skipped
+                skipBytes += nElements * size;
+            }
+        } else if (keyword == "end_header") {
+            hasHeaderEnd = true;
+            break;
+        }
+    }
+    if (!hasHeaderEnd || !binary) {
+        throw std::runtime_error("Only binary little-endian PLY files are supported: " + filename);
+    }
+
+    // Vertex properties to be read
+    const Property *fields[6] = { nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
+    static const char *names[6] = { "x", "y", "z", "nx", "ny", "nz" };
+    for (const auto &prop : properties) {
+        for (int k = 0; k < 6; k++) {
+            if (prop.name == names[k]) {
+                if (prop.size != 4 && prop.size != 8) {
+                    throw std::runtime_error("Property \"" + prop.name + "\" must be float or double: " + filename);
+                }
+                fields[k] = &prop;
+            }
+        }
+    }
+    for (int k = 0; k < (normals ? 6 : 3); k++) {
+        if (fields[k] == nullptr) {
+            throw std::runtime_error(std::string("PLY file has no vertex property \"") + names[k] + "\": " + filename);
+        }
+    }
+
+    const char *data = p + skipBytes;
+    if (nVerts * stride > (size_t)(end - data)) {
+        throw std::runtime_error("PLY file is truncated: " + filename);
+    }
+
+    const size_t base = positions->size();
+    positions->resize(base + nVerts);
+    if (normals) {
+        normals->resize(base + nVerts);
+    }
+
+    const auto readValue = [](const char *record, const Property *prop) -> double {
+        if (prop->size == 8) {
+            double v;
+            std::memcpy(&v, record + prop->offset, sizeof(double));
+            return v;
+        }
+        float v;
+        std::memcpy(&v, record + prop->offset, sizeof(float));
+        return v;
+    };
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int64_t i = 0; i < (int64_t)nVerts; i++) {
+        const char *record = data + i * stride;
+        (*positions)[base + i] = Vec3(readValue(record, fields[0]), readValue(record, fields[1]),
+                                      readValue(record, fields[2]));
         if (normals) {
-            normals->push_back(n);
+            (*normals)[base + i] = Vec3(readValue(record, fields[3]), readValue(record, fields[4]),
+                                        readValue(record, fields[5]));
         }
     }
+}
 
-    reader.close();
+// Load point cloud from an OFF or PLY file, which is chosen by the file extension
+inline void read_points(const std::string &filename, std::vector<Vec3> *positions,
+                        std::vector<Vec3> *normals = nullptr) {
+    const size_t pos = filename.find_last_of('.');
+    std::string extension = pos != std::string::npos ? filename.substr(pos + 1) : "";
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "ply") {
+        read_ply(filename, positions, normals);
+    } else {
+        read_off(filename, positions, normals);
+    }
 }
 
 // Write OFF mesh file (only point cloud will be written)
 inline void write_off(const std::string &filename, const std::vector<Vec3> &positions,
                       const std::vector<Vec3> &normals = std::vector<Vec3>()) {
-    std::ofstream writer(filename.c_str(), std::ios::out);
+    std::ofstream writer(filename.c_str(), std::ios::out | std::ios::binary);
     if (writer.fail()) {
         throw std::runtime_error("Failed to open file: " + filename);
     }
 
     // Magic word
     if (normals.empty()) {
-        writer << "OFF" << std::endl;
+        writer << "OFF\n";
     } else {
         if (positions.size() != normals.size()) {
             throw std::runtime_error("#pos and #norm do not match!");
         }
-        writer << "NOFF" << std::endl;
+        writer << "NOFF\n";
     }
 
-    const int nVerts = positions.size();
+    const size_t nVerts = positions.size();
     const int nFaces = 0;
     const int nEdges = 0;
-    writer << nVerts << " " << nFaces << " " << nEdges << std::endl;
+    writer << nVerts << " " << nFaces << " " << nEdges << "\n";
 
-    for (int i = 0; i < nVerts; i++) {
-        const Vec3 &p = positions[i];
-        writer << p.x << " " << p.y << " " << p.z;
+    io_detail::writeChunks(writer, nVerts, [&](size_t i, std::string *text) {
+        char buf[256];
+        int len = 0;
+        for (int k = 0; k < 3; k++) {
+            if (k != 0) {
+                buf[len++] = ' ';
+            }
+            len += format_double(positions[i][k], buf + len);
+        }
         if (!normals.empty()) {
-            const Vec3 &n = normals[i];
-            writer << " " << n.x << " " << n.y << " " << n.z;
+            for (int k = 0; k < 3; k++) {
+                buf[len++] = ' ';
+                len += format_double(normals[i][k], buf + len);
+            }
         }
-        writer << std::endl;
-    }
+        buf[len++] = '\n';
+        text->append(buf, len);
+    });
 
     writer.close();
 }
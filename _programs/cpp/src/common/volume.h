@@ -6,56 +6,80 @@
 #include <fstream>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <mutex>
 
 #include "debug.h"
+#include "histogram.h"
 
-struct Volume {
-    Volume() = default;
+//! Volume of the voxels of type "T". The voxels of "Volume" are normalized by USHRT_MAX, whereas those of
+//! "FloatVolume" are used as they are (e.g., signed distances), and so are the thresholds for them.
+template <typename T>
+struct BasicVolume {
+    using value_type = T;
 
-    Volume(uint64_t sizeX, uint64_t sizeY, uint64_t sizeZ) {
+    BasicVolume() = default;
+
+    BasicVolume(uint64_t sizeX, uint64_t sizeY, uint64_t sizeZ) {
         sizes = { sizeX, sizeY, sizeZ };
-        data = std::make_unique<uint16_t[]>(sizeX * sizeY * sizeZ);
+        data = std::make_unique<T[]>(sizeX * sizeY * sizeZ);
     }
 
-    Volume(const std::string &filename, int sizeX, int sizeY, int sizeZ)
-        : Volume(sizeX, sizeY, sizeZ) {
+    BasicVolume(const std::string &filename, int sizeX, int sizeY, int sizeZ)
+        : BasicVolume(sizeX, sizeY, sizeZ) {
         load(filename);
     }
 
-    Volume(const Volume &other)
-        : Volume(other.sizes[0], other.sizes[1], other.sizes[2]) {
+    BasicVolume(const BasicVolume &other)
+        : BasicVolume(other.sizes[0], other.sizes[1], other.sizes[2]) {
         const auto totalSize = sizes[0] * sizes[1] * sizes[2];
-        std::memcpy(data.get(), other.data.get(), sizeof(uint16_t) * totalSize);
+        std::memcpy(data.get(), other.data.get(), sizeof(T) * totalSize);
+        std::lock_guard<std::mutex> lock(other.histMutex);
+        hist = other.hist;
+        histValid = other.histValid.load();
     }
 
-    Volume(Volume &&other) noexcept {
+    BasicVolume(BasicVolume &&other) noexcept {
         sizes = other.sizes;
         data = std::move(other.data);
+        hist = std::move(other.hist);
+        histValid = other.histValid.exchange(false);
     }
 
-    virtual ~Volume() = default;
+    virtual ~BasicVolume() = default;
 
-    Volume &operator=(Volume other) {
+    BasicVolume &operator=(BasicVolume other) {
         swap(*this, other);
         return *this;
     }
 
-    friend void swap(Volume &first, Volume &second) {
+    friend void swap(BasicVolume &first, BasicVolume &second) {
         using std::swap;
         if (&first != &second) {
             swap(first.sizes, second.sizes);
             swap(first.data, second.data);
+            swap(first.hist, second.hist);
+            first.histValid = second.histValid.exchange(first.histValid.load());
         }
     }
 
-    uint16_t &operator()(int x, int y, int z) {
+    //! As the voxel may be modified through the reference, the cached histogram is invalidated
+    T &operator()(int x, int y, int z) {
+        if (histValid.load(std::memory_order_relaxed)) {
+            histValid.store(false, std::memory_order_relaxed);
+        }
         return data[(z * sizes[1] + y) * sizes[0] + x];
     }
 
-    uint16_t operator()(int x, int y, int z) const {
+    T operator()(int x, int y, int z) const {
         return data[(z * sizes[1] + y) * sizes[0] + x];
     }
 
+    //! Pointer to the contiguous row of voxels at (y, z)
+    const T *row(uint64_t y, uint64_t z) const {
+        return data.get() + (z * sizes[1] + y) * sizes[0];
+    }
+
     uint64_t size(int i) const {
         if (i < 0 || i >= 3) {
             throw std::runtime_error("Dimension index out of bounds!");
@@ -63,7 +87,26 @@ struct Volume {
         return sizes[i];
     }
 
+    //! Histogram of the voxel values, which is built at the first call and cached (only for "Volume").
+    //! It can be called from multiple threads, and is rebuilt after the voxels are accessed through the
+    //! non-const "operator()". The reference is valid until the voxels are modified.
+    const Histogram &histogram() const {
+        std::lock_guard<std::mutex> lock(histMutex);
+        if (!hist || !histValid.load()) {
+            hist = std::make_shared<const Histogram>(data.get(), sizes[0] * sizes[1] * sizes[2]);
+            histValid = true;
+        }
+        return *hist;
+    }
+
+    void invalidateHistogram() {
+        std::lock_guard<std::mutex> lock(histMutex);
+        hist.reset();
+        histValid = false;
+    }
+
     void load(const std::string &filename) {
+        invalidateHistogram();
         // {{ NOT_IMPL_ERROR();
         std::ifstream reader(filename.c_str(), std::ios::in | std::ios::binary);
         if (reader.fail()) {
@@ -72,8 +115,8 @@ struct Volume {
 
         for (uint64_t z = 0; z < sizes[2]; z++) {
             for (uint64_t y = 0; y < sizes[1]; y++) {
-                uint16_t *ptr = data.get() + (z * sizes[1] + y) * sizes[0];
-                reader.read((char*)ptr, sizeof(uint16_t) * sizes[0]);
+                T *ptr = data.get() + (z * sizes[1] + y) * sizes[0];
+                reader.read((char*)ptr, sizeof(T) * sizes[0]);
             }
         }
         reader.close();
@@ -81,6 +124,12 @@ struct Volume {
     }
 
 private:
-    std::array<uint64_t, 3> sizes;
-    std::unique_ptr<uint16_t[]> data = nullptr;
+    std::array<uint64_t, 3> sizes = { 0, 0, 0 };
+    std::unique_ptr<T[]> data = nullptr;
+    mutable std::shared_ptr<const Histogram> hist = nullptr;
+    mutable std::atomic<bool> histValid{ false };
+    mutable std::mutex histMutex;
 };
+
+using Volume = BasicVolume<uint16_t>;
+using FloatVolume = BasicVolume<float>;
@@ -8,7 +8,7 @@
 
 int main(int argc, char **argv) {
     if (argc <= 2) {
-        fprintf(stderr, "[ USAGE ] icp_exe [ *.off file ] [ *.off file ] [ iteration ] [ tolerance ]\n");
+        fprintf(stderr, "[ USAGE ] icp_exe [ *.off|*.ply file ] [ *.off|*.ply file ] [ iteration ] [ tolerance ]\n");
         std::exit(1);
     }
 
@@ -21,8 +21,8 @@ int main(int argc, char **argv) {
         std::vector<Vec3> norm0;
         std::vector<Vec3> pos1;
         std::vector<Vec3> norm1;
-        read_off(argv[1], &pos0, &norm0);
-        read_off(argv[2], &pos1, &norm1);
+        read_points(argv[1], &pos0, &norm0);
+        read_points(argv[2], &pos1, &norm1);
         printf("PCL #0: %ld points\n", pos0.size());
         printf("PCL #1: %ld points\n", pos1.size());
 
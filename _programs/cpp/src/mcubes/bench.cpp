@@ -0,0 +1,271 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <bitset>
+#include <functional>
+#include <string>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "common/timer.h"
+#include "common/volume.h"
+#include "classify.h"
+#include "mcubes.h"
+#include "mcubes_utils.h"
+
+// Synthetic volume with two blobs and noise, used when no volume file is given
+static Volume syntheticVolume(int size) {
+    Volume volume(size, size, size);
+    std::mt19937 rng(31415);
+    std::uniform_real_distribution<double> noise(0.0, 0.02);
+    for (int z = 0; z < size; z++) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                const double r0 = std::sqrt((x - size * 0.5) * (x - size * 0.5) + (y - size * 0.5) * (y - size * 0.5) +
+                                            (z - size * 0.5) * (z - size * 0.5));
+                const double r1 = std::sqrt((x - size * 0.3) * (x - size * 0.3) + (y - size * 0.6) * (y - size * 0.6) +
+                                            (z - size * 0.4) * (z - size * 0.4));
+                double value = std::max(0.0, 1.0 - r0 / (0.4 * size)) * 0.6;
+                value += std::max(0.0, 1.0 - r1 / (0.15 * size)) * 0.5;
+                value = std::min(1.0, value + noise(rng));
+                volume(x, y, z) = (uint16_t)(value * USHRT_MAX);
+            }
+        }
+    }
+    return volume;
+}
+
+// Signed distance to two overlapping spheres at "p" in the unit cube
+static double sphereDistance(const Vec3 &p) {
+    const double d0 = length(p - Vec3(0.5, 0.5, 0.5)) - 0.3;
+    const double d1 = length(p - Vec3(0.3, 0.6, 0.4)) - 0.12;
+    return std::min(d0, d1);
+}
+
+// Signed distance field of the above, where the unit cube is mapped to the lattice of the size
+static FloatVolume syntheticField(uint64_t size) {
+    FloatVolume field(size, size, size);
+    for (uint64_t z = 0; z < size; z++) {
+        for (uint64_t y = 0; y < size; y++) {
+            for (uint64_t x = 0; x < size; x++) {
+                field(x, y, z) = (float)sphereDistance(Vec3(x, y, z) / (double)size);
+            }
+        }
+    }
+    return field;
+}
+
+// Run "func" for several times and return the fastest time in seconds
+static double bestOf(int trials, const std::function<void()> &func) {
+    double best = 1.0e20;
+    for (int t = 0; t < trials; t++) {
+        Timer timer;
+        timer.start();
+        func();
+        best = std::min(best, timer.stop());
+    }
+    return best;
+}
+
+// Regression check of the extractors on a sphere which crosses the max faces of the volume, where the cells
+// around the crossing edges on the faces are outside the volume
+static bool checkBoundaryFaces() {
+    const uint64_t size = 24;
+    FloatVolume field(size, size, size);
+    for (uint64_t z = 0; z < size; z++) {
+        for (uint64_t y = 0; y < size; y++) {
+            for (uint64_t x = 0; x < size; x++) {
+                field(x, y, z) = (float)(length(Vec3(x, y, z) - Vec3(16.0)) - 10.0);
+            }
+        }
+    }
+
+    using Extractor = std::function<void(std::vector<Vec3> *, std::vector<uint32_t> *)>;
+    const std::pair<const char *, Extractor> extractors[] = {
+        { "marchCubes", [&](std::vector<Vec3> *v, std::vector<uint32_t> *f) { marchCubes(field, v, f); } },
+        { "surfaceNets", [&](std::vector<Vec3> *v, std::vector<uint32_t> *f) { surfaceNets(field, v, f); } },
+        { "dualContour", [&](std::vector<Vec3> *v, std::vector<uint32_t> *f) { dualContour(field, v, f); } },
+        { "dualContourAdaptive",
+          [&](std::vector<Vec3> *v, std::vector<uint32_t> *f) { dualContourAdaptive(field, v, f); } },
+    };
+
+    bool success = true;
+    for (const auto &extractor : extractors) {
+        std::vector<Vec3> vertices;
+        std::vector<uint32_t> indices;
+        try {
+            extractor.second(&vertices, &indices);
+        } catch (const std::exception &e) {
+            fprintf(stderr, "Boundary check failed (%s): %s\n", extractor.first, e.what());
+            success = false;
+            continue;
+        }
+
+        const bool valid = std::all_of(indices.begin(), indices.end(), [&](uint32_t i) { return i < vertices.size(); });
+        if (indices.empty() || !valid) {
+            fprintf(stderr, "Boundary check failed (%s): invalid mesh\n", extractor.first);
+            success = false;
+        }
+    }
+    return success;
+}
+
+static void report(const char *name, double seconds, uint64_t nCells, const char *label, uint64_t count) {
+    printf("%-24s %8.3f sec  %7.2f ns/cell  %8.2f Mcells/s  %s: %llu\n", name, seconds, seconds * 1.0e9 / nCells,
+           nCells / seconds * 1.0e-6, label, (unsigned long long)count);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && argc <= 4) {
+        fprintf(stderr, "[ USAGE ] mcubes_bench [ *.vol file ] [ width ] [ height ] [ dims ] [ threshold ]\n");
+        std::exit(1);
+    }
+
+    if (!checkBoundaryFaces()) {
+        std::exit(1);
+    }
+
+    const Volume volume = argc > 4 ? Volume(argv[1], std::atoi(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]))
+                                   : syntheticVolume(192);
+    const double threshold = argc > 5 ? std::atof(argv[5]) : 0.3;
+    const uint64_t nCells = (volume.size(0) - 1) * (volume.size(1) - 1) * (volume.size(2) - 1);
+    const int trials = 5;
+    printf("Size: %d x %d x %d, threshold: %.5f\n", (int)volume.size(0), (int)volume.size(1), (int)volume.size(2),
+           threshold);
+
+    // Per-cell throughput of the original polygonizer (without vertex welding) and the extraction engine
+    static int indexTable[8] = { 0, 1, 4, 5, 3, 2, 7, 6 };
+    uint64_t nTris = 0;
+    double checksum = 0.0;
+
+    const double tGrid = bestOf(trials, [&]() {
+        GRIDCELL cell;
+        TRIANGLE tris[16];
+        nTris = 0;
+        for (uint64_t z = 0; z < volume.size(2) - 1; z++) {
+            for (uint64_t y = 0; y < volume.size(1) - 1; y++) {
+                for (uint64_t x = 0; x < volume.size(0) - 1; x++) {
+                    for (int i = 0; i < 8; i++) {
+                        const int dx = (i >> 0) & 0x01;
+                        const int dy = (i >> 1) & 0x01;
+                        const int dz = (i >> 2) & 0x01;
+                        cell.p[indexTable[i]] = Vec3(x + dx, y + dy, z + dz);
+                        cell.val[indexTable[i]] = volume(x + dx, y + dy, z + dz) / (double)USHRT_MAX;
+                    }
+
+                    std::fill(tris, tris + 16, TRIANGLE());
+                    const int ntris = Polygonise(cell, threshold, tris);
+                    for (int i = 0; i < ntris; i++) {
+                        checksum += tris[i].p[0].x;
+                    }
+                    nTris += ntris;
+                }
+            }
+        }
+    });
+    report("GRIDCELL + Polygonise", tGrid, nCells, "#tris", nTris);
+
+    // The extraction engine of "marchCubes", which also welds the vertices and runs on all the threads
+    std::vector<Vec3> vertices;
+    std::vector<uint32_t> indices;
+    const auto runEngine = [&](bool flipFaces) {
+        marchCubes(volume, &vertices, &indices, threshold, flipFaces);
+        checksum += vertices.empty() ? 0.0 : vertices[indices[0]].x;
+    };
+
+    const double tFast = bestOf(trials, [&]() { runEngine(false); });
+    report("marchCubes", tFast, nCells, "#tris", indices.size() / 3);
+
+    const double tFlip = bestOf(trials, [&]() { runEngine(true); });
+    report("marchCubes (flipped)", tFlip, nCells, "#tris", indices.size() / 3);
+
+    printf("Speed-up: %.2fx (checksum: %f)\n", tGrid / tFast, checksum);
+
+    const uint32_t isoLevel = IsoLevelFromThreshold(threshold);
+
+    // Classification of all the cells, one by one and by rows of voxels
+    uint64_t nActive = 0;
+    const double tCell = bestOf(trials, [&]() {
+        uint16_t val[8];
+        nActive = 0;
+        for (uint64_t z = 0; z < volume.size(2) - 1; z++) {
+            for (uint64_t y = 0; y < volume.size(1) - 1; y++) {
+                for (uint64_t x = 0; x < volume.size(0) - 1; x++) {
+                    for (int i = 0; i < 8; i++) {
+                        const int *d = cubeVertexOffsets[i];
+                        val[i] = volume(x + d[0], y + d[1], z + d[2]);
+                    }
+                    int cubeindex = 0;
+                    for (int i = 0; i < 8; i++) {
+                        cubeindex |= (val[i] < isoLevel ? 1 : 0) << i;
+                    }
+                    nActive += cubeindex != 0 && cubeindex != 255;
+                }
+            }
+        }
+    });
+    report("Cube index (per cell)", tCell, nCells, "#active", nActive);
+
+    const double tRow = bestOf(trials, [&]() {
+        const uint64_t nx = volume.size(0);
+        std::vector<uint64_t> m00(RowMaskWords(nx)), m10(RowMaskWords(nx)), m01(RowMaskWords(nx)),
+            m11(RowMaskWords(nx)), active(RowMaskWords(nx));
+        std::vector<uint8_t> cases(nx);
+        nActive = 0;
+        for (uint64_t z = 0; z < volume.size(2) - 1; z++) {
+            ClassifyRow(volume.row(0, z), nx, isoLevel, m00.data());
+            ClassifyRow(volume.row(0, z + 1), nx, isoLevel, m01.data());
+            for (uint64_t y = 0; y < volume.size(1) - 1; y++) {
+                ClassifyRow(volume.row(y + 1, z), nx, isoLevel, m10.data());
+                ClassifyRow(volume.row(y + 1, z + 1), nx, isoLevel, m11.data());
+                ClassifyCells(m00.data(), m10.data(), m01.data(), m11.data(), nx - 1, active.data(), cases.data());
+                for (uint64_t w = 0; w < RowMaskWords(nx - 1); w++) {
+                    nActive += std::bitset<64>(active[w]).count();
+                }
+                std::swap(m00, m10);
+                std::swap(m01, m11);
+            }
+        }
+    });
+    const std::string name = std::string("ClassifyRow (") + ClassifyKernelName() + ")";
+    report(name.c_str(), tRow, nCells, "#active", nActive);
+
+    // Marching cubes of a signed distance field in [-1, 1], which is passed as it is or quantized into 16-bit
+    // voxels beforehand, as the callers of the quantized path do. The errors of the vertices are the distances
+    // to the surface in voxels, which include the error of the linear interpolation.
+    const uint64_t fieldSize = volume.size(0);
+    const FloatVolume field = syntheticField(fieldSize);
+
+    std::vector<Vec3> floatVerts, quantVerts;
+    std::vector<uint32_t> floatFaces, quantFaces;
+    const double tFloat = bestOf(trials, [&]() { marchCubes(field, &floatVerts, &floatFaces, 0.0); });
+
+    const double tQuant = bestOf(trials, [&]() {
+        Volume quantized(fieldSize, fieldSize, fieldSize);
+        for (uint64_t z = 0; z < fieldSize; z++) {
+            for (uint64_t y = 0; y < fieldSize; y++) {
+                for (uint64_t x = 0; x < fieldSize; x++) {
+                    const double value = std::max(-1.0, std::min((double)field(x, y, z), 1.0));
+                    quantized(x, y, z) = (uint16_t)((value + 1.0) * 0.5 * USHRT_MAX);
+                }
+            }
+        }
+        marchCubes(quantized, &quantVerts, &quantFaces, 0.5);
+    });
+
+    const auto meanError = [&](const std::vector<Vec3> &vertices) {
+        double error = 0.0;
+        for (const auto &v : vertices) {
+            error += std::abs(sphereDistance(v / (double)fieldSize)) * fieldSize;
+        }
+        return error / std::max((size_t)1, vertices.size());
+    };
+    const uint64_t nFieldCells = (fieldSize - 1) * (fieldSize - 1) * (fieldSize - 1);
+    report("marchCubes (uint16)", tQuant, nFieldCells, "#tris", quantFaces.size() / 3);
+    report("marchCubes (float)", tFloat, nFieldCells, "#tris", floatFaces.size() / 3);
+    printf("Speed-up: %.2fx (mean error: %.6f -> %.6f voxels)\n", tQuant / tFloat, meanError(quantVerts),
+           meanError(floatVerts));
+}
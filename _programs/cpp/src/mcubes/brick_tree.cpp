@@ -0,0 +1,148 @@
+#include "brick_tree.h"
+
+#include <limits>
+#include <stack>
+
+template <typename T>
+BasicBrickTree<T>::BasicBrickTree(const BasicVolume<T> &volume, int brickSize)
+    : brickSize_(brickSize) {
+    for (int i = 0; i < 3; i++) {
+        sizes[i] = volume.size(i);
+        numBricks[i] = sizes[i] > 1 ? (sizes[i] - 2) / brickSize + 1 : 0;
+    }
+
+    // Value ranges of bricks, each of which includes the voxels shared with the next bricks.
+    Level leaf;
+    leaf.sizes = numBricks;
+    leaf.minVals.assign(totalBricks(), std::numeric_limits<T>::max());
+    leaf.maxVals.assign(totalBricks(), std::numeric_limits<T>::lowest());
+
+    #ifdef _OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int64_t bz = 0; bz < (int64_t)numBricks[2]; bz++) {
+        for (uint64_t by = 0; by < numBricks[1]; by++) {
+            for (uint64_t bx = 0; bx < numBricks[0]; bx++) {
+                const uint64_t id = (bz * numBricks[1] + by) * numBricks[0] + bx;
+                T minVal = std::numeric_limits<T>::max();
+                T maxVal = std::numeric_limits<T>::lowest();
+                for (uint64_t z = cellBegin(bz, 2); z <= cellEnd(bz, 2); z++) {
+                    for (uint64_t y = cellBegin(by, 1); y <= cellEnd(by, 1); y++) {
+                        for (uint64_t x = cellBegin(bx, 0); x <= cellEnd(bx, 0); x++) {
+                            const T val = volume(x, y, z);
+                            minVal = std::min(minVal, val);
+                            maxVal = std::max(maxVal, val);
+                        }
+                    }
+                }
+                leaf.minVals[id] = minVal;
+                leaf.maxVals[id] = maxVal;
+            }
+        }
+    }
+    levels.push_back(std::move(leaf));
+
+    // Octree over the bricks
+    while (levels.back().sizes[0] > 1 || levels.back().sizes[1] > 1 || levels.back().sizes[2] > 1) {
+        const Level &child = levels.back();
+        Level parent;
+        for (int i = 0; i < 3; i++) {
+            parent.sizes[i] = (child.sizes[i] + 1) / 2;
+        }
+        const uint64_t total = parent.sizes[0] * parent.sizes[1] * parent.sizes[2];
+        parent.minVals.assign(total, std::numeric_limits<T>::max());
+        parent.maxVals.assign(total, std::numeric_limits<T>::lowest());
+
+        for (uint64_t z = 0; z < child.sizes[2]; z++) {
+            for (uint64_t y = 0; y < child.sizes[1]; y++) {
+                for (uint64_t x = 0; x < child.sizes[0]; x++) {
+                    const uint64_t src = (z * child.sizes[1] + y) * child.sizes[0] + x;
+                    const uint64_t dst = ((z / 2) * parent.sizes[1] + (y / 2)) * parent.sizes[0] + (x / 2);
+                    parent.minVals[dst] = std::min(parent.minVals[dst], child.minVals[src]);
+                    parent.maxVals[dst] = std::max(parent.maxVals[dst], child.maxVals[src]);
+                }
+            }
+        }
+        levels.push_back(std::move(parent));
+    }
+}
+
+template <typename T>
+void BasicBrickTree<T>::activeBricks(IsoLevel isoLevel, std::vector<uint64_t> *bricks) const {
+    activeBricks(std::vector<IsoLevel>{ isoLevel }, bricks);
+}
+
+template <typename T>
+void BasicBrickTree<T>::activeSpans(IsoLevel isoLevel, std::vector<Span> *spans) const {
+    activeSpans(std::vector<IsoLevel>{ isoLevel }, spans);
+}
+
+template <typename T>
+void BasicBrickTree<T>::activeBricks(const std::vector<IsoLevel> &isoLevels, std::vector<uint64_t> *bricks) const {
+    bricks->clear();
+    if (totalBricks() == 0) {
+        return;
+    }
+
+    // Voxels with values less than the iso-level are inside, so that a node may contain
+    // the iso-surface only when it has both the inside and outside voxels.
+    struct Node {
+        int level;
+        uint64_t x, y, z;
+    };
+
+    std::stack<Node> nodeStack;
+    nodeStack.push({ (int)levels.size() - 1, 0, 0, 0 });
+    while (!nodeStack.empty()) {
+        const Node node = nodeStack.top();
+        nodeStack.pop();
+
+        const Level &level = levels[node.level];
+        const uint64_t id = (node.z * level.sizes[1] + node.y) * level.sizes[0] + node.x;
+        const bool straddle = std::any_of(isoLevels.begin(), isoLevels.end(), [&](IsoLevel isoLevel) {
+            return level.minVals[id] < isoLevel && level.maxVals[id] >= isoLevel;
+        });
+        if (!straddle) {
+            continue;
+        }
+
+        if (node.level == 0) {
+            bricks->push_back(id);
+            continue;
+        }
+
+        const Level &child = levels[node.level - 1];
+        for (int i = 0; i < 8; i++) {
+            const uint64_t cx = node.x * 2 + ((i >> 0) & 0x01);
+            const uint64_t cy = node.y * 2 + ((i >> 1) & 0x01);
+            const uint64_t cz = node.z * 2 + ((i >> 2) & 0x01);
+            if (cx < child.sizes[0] && cy < child.sizes[1] && cz < child.sizes[2]) {
+                nodeStack.push({ node.level - 1, cx, cy, cz });
+            }
+        }
+    }
+
+    std::sort(bricks->begin(), bricks->end());
+}
+
+template <typename T>
+void BasicBrickTree<T>::activeSpans(const std::vector<IsoLevel> &isoLevels, std::vector<Span> *spans) const {
+    std::vector<uint64_t> bricks;
+    activeBricks(isoLevels, &bricks);
+
+    spans->clear();
+    for (uint64_t brick : bricks) {
+        const auto b = brickIndex(brick);
+        if (!spans->empty()) {
+            Span &last = spans->back();
+            if (last.y == b[1] && last.z == b[2] && last.end == b[0]) {
+                last.end += 1;
+                continue;
+            }
+        }
+        spans->push_back({ b[1], b[2], b[0], b[0] + 1 });
+    }
+}
+
+template class BasicBrickTree<uint16_t>;
+template class BasicBrickTree<float>;
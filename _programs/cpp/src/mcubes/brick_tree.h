@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+
+#include "common/volume.h"
+#include "mcubes_utils.h"
+
+//! Run of consecutive bricks [begin, end) along the x-axis in the brick row (y, z)
+struct BrickSpan {
+    uint64_t y, z;
+    uint64_t begin, end;
+};
+
+//! Min/max hierarchy over bricks of a volume, used to skip empty space during extraction.
+//! A brick covers "brickSize^3" cells, i.e., "(brickSize + 1)^3" voxels shared with its neighbors,
+//! and the upper levels form an octree over the bricks. The hierarchy does not depend on the
+//! threshold, so the same tree can be reused for any number of iso-levels.
+template <typename T>
+class BasicBrickTree {
+public:
+    using Span = BrickSpan;
+    using IsoLevel = typename VoxelTraits<T>::IsoLevel;
+
+    BasicBrickTree() = default;
+    explicit BasicBrickTree(const BasicVolume<T> &volume, int brickSize = 8);
+
+    //! List bricks whose value range straddles the iso-level (in ascending order of brick ID).
+    //! The iso-level is given in the voxel value domain (see "VoxelTraits::isoLevel").
+    void activeBricks(IsoLevel isoLevel, std::vector<uint64_t> *bricks) const;
+
+    //! Merge the active bricks into runs along the x-axis, so that voxel rows can be processed at once.
+    void activeSpans(IsoLevel isoLevel, std::vector<Span> *spans) const;
+
+    //! Same as above, but list bricks which straddle at least one of the iso-levels.
+    void activeBricks(const std::vector<IsoLevel> &isoLevels, std::vector<uint64_t> *bricks) const;
+    void activeSpans(const std::vector<IsoLevel> &isoLevels, std::vector<Span> *spans) const;
+
+    //! Brick ID to brick coordinates
+    std::array<uint64_t, 3> brickIndex(uint64_t brick) const {
+        const uint64_t bx = brick % numBricks[0];
+        const uint64_t by = (brick / numBricks[0]) % numBricks[1];
+        const uint64_t bz = brick / (numBricks[0] * numBricks[1]);
+        return { bx, by, bz };
+    }
+
+    //! Range of cells [begin, end) covered by the brick along the axis
+    uint64_t cellBegin(uint64_t b, int axis) const {
+        return b * brickSize_;
+    }
+
+    uint64_t cellEnd(uint64_t b, int axis) const {
+        return std::min((b + 1) * brickSize_, sizes[axis] - 1);
+    }
+
+    //! Range of voxels [begin, end) whose lower index belongs to the brick along the axis.
+    //! Unlike the cell range, the last brick also owns the last voxel.
+    uint64_t voxelBegin(uint64_t b, int axis) const {
+        return b * brickSize_;
+    }
+
+    uint64_t voxelEnd(uint64_t b, int axis) const {
+        return b == numBricks[axis] - 1 ? sizes[axis] : (b + 1) * brickSize_;
+    }
+
+    int brickSize() const {
+        return brickSize_;
+    }
+
+    uint64_t size(int i) const {
+        return numBricks[i];
+    }
+
+    uint64_t totalBricks() const {
+        return numBricks[0] * numBricks[1] * numBricks[2];
+    }
+
+private:
+    struct Level {
+        std::array<uint64_t, 3> sizes;
+        std::vector<T> minVals;
+        std::vector<T> maxVals;
+    };
+
+    int brickSize_ = 8;
+    std::array<uint64_t, 3> sizes = { 0, 0, 0 };
+    std::array<uint64_t, 3> numBricks = { 0, 0, 0 };
+    std::vector<Level> levels;
+};
+
+using BrickTree = BasicBrickTree<uint16_t>;
+using FloatBrickTree = BasicBrickTree<float>;
@@ -0,0 +1,247 @@
+#include "classify.h"
+
+#include <cstring>
+#include <climits>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MCUBES_X86
+#include <immintrin.h>
+#endif
+
+#if defined(MCUBES_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace {
+
+using ClassifyFunc = void (*)(const uint16_t *, uint64_t, uint16_t, uint64_t *);
+using ClassifyFloatFunc = void (*)(const float *, uint64_t, float, uint64_t *);
+
+// Scalar loop for the voxels [begin, n). "isoLevel" is in [1, USHRT_MAX] for 16-bit voxels,
+// and "mask" is cleared beforehand.
+template <typename T>
+inline void classifyRange(const T *row, uint64_t begin, uint64_t n, T isoLevel, uint64_t *mask) {
+    for (uint64_t x = begin; x < n; x++) {
+        mask[x >> 6] |= (uint64_t)(row[x] < isoLevel) << (x & 63);
+    }
+}
+
+#ifndef MCUBES_X86
+
+void classifyScalar(const uint16_t *row, uint64_t n, uint16_t isoLevel, uint64_t *mask) {
+    classifyRange(row, 0, n, isoLevel, mask);
+}
+
+void classifyFloatScalar(const float *row, uint64_t n, float isoLevel, uint64_t *mask) {
+    classifyRange(row, 0, n, isoLevel, mask);
+}
+
+#else
+
+// SSE2 kernel (16 voxels per iteration). Unsigned comparison is emulated
+// with signed comparison by flipping the sign bits of both operands.
+void classifySSE2(const uint16_t *row, uint64_t n, uint16_t isoLevel, uint64_t *mask) {
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    const __m128i level = _mm_set1_epi16((short)(isoLevel ^ 0x8000));
+
+    uint64_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        const __m128i v0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(row + x)), sign);
+        const __m128i v1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(row + x + 8)), sign);
+        const __m128i in0 = _mm_cmpgt_epi16(level, v0);
+        const __m128i in1 = _mm_cmpgt_epi16(level, v1);
+        const uint64_t bits = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(in0, in1));
+        mask[x >> 6] |= bits << (x & 63);
+    }
+    classifyRange(row, x, n, isoLevel, mask);
+}
+
+// AVX2 kernel (64 voxels per iteration). "packs" works in each 128-bit lane,
+// so that the 64-bit blocks are permuted back to the voxel order. The rest of
+// the row starts at a word boundary, and is passed to the SSE2 kernel.
+TARGET_AVX2
+void classifyAVX2(const uint16_t *row, uint64_t n, uint16_t isoLevel, uint64_t *mask) {
+    const __m256i sign = _mm256_set1_epi16((short)0x8000);
+    const __m256i level = _mm256_set1_epi16((short)(isoLevel ^ 0x8000));
+
+    uint64_t x = 0;
+    for (; x + 64 <= n; x += 64) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 2; k++) {
+            const uint16_t *p = row + x + k * 32;
+            const __m256i v0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)p), sign);
+            const __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 16)), sign);
+            const __m256i in0 = _mm256_cmpgt_epi16(level, v0);
+            const __m256i in1 = _mm256_cmpgt_epi16(level, v1);
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(in0, in1), 0xd8);
+            bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(packed) << (k * 32);
+        }
+        mask[x >> 6] = bits;
+    }
+    classifySSE2(row + x, n - x, isoLevel, mask + (x >> 6));
+}
+
+// Float kernels, which compare 4 (SSE2) or 8 (AVX2) voxels at once. The comparisons are ordered,
+// so that NaN voxels are outside as in the scalar loop.
+void classifyFloatSSE2(const float *row, uint64_t n, float isoLevel, uint64_t *mask) {
+    const __m128 level = _mm_set1_ps(isoLevel);
+
+    uint64_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 4; k++) {
+            const __m128 v = _mm_loadu_ps(row + x + k * 4);
+            bits |= (uint64_t)_mm_movemask_ps(_mm_cmplt_ps(v, level)) << (k * 4);
+        }
+        mask[x >> 6] |= bits << (x & 63);
+    }
+    classifyRange(row, x, n, isoLevel, mask);
+}
+
+TARGET_AVX2
+void classifyFloatAVX2(const float *row, uint64_t n, float isoLevel, uint64_t *mask) {
+    const __m256 level = _mm256_set1_ps(isoLevel);
+
+    uint64_t x = 0;
+    for (; x + 64 <= n; x += 64) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 8; k++) {
+            const __m256 v = _mm256_loadu_ps(row + x + k * 8);
+            bits |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(v, level, _CMP_LT_OQ)) << (k * 8);
+        }
+        mask[x >> 6] = bits;
+    }
+    classifyFloatSSE2(row + x, n - x, isoLevel, mask + (x >> 6));
+}
+
+bool supportsAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x06) != 0x06) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif  // MCUBES_X86
+
+struct ClassifyKernel {
+    ClassifyFunc func;
+    ClassifyFloatFunc floatFunc;
+    const char *name;
+};
+
+const ClassifyKernel &selectKernel() {
+    static const ClassifyKernel kernel = []() -> ClassifyKernel {
+#ifdef MCUBES_X86
+        if (supportsAVX2()) {
+            return { classifyAVX2, classifyFloatAVX2, "avx2" };
+        }
+        return { classifySSE2, classifyFloatSSE2, "sse2" };
+#else
+        return { classifyScalar, classifyFloatScalar, "scalar" };
+#endif
+    }();
+    return kernel;
+}
+
+}  // anonymous namespace
+
+void ClassifyRow(const uint16_t *row, uint64_t n, uint32_t isoLevel, uint64_t *mask) {
+    const uint64_t nWords = RowMaskWords(n);
+    std::memset(mask, 0, sizeof(uint64_t) * nWords);
+    if (isoLevel == 0 || n == 0) {
+        return;
+    }
+
+    if (isoLevel > USHRT_MAX) {
+        std::memset(mask, 0xff, sizeof(uint64_t) * nWords);
+        if (n & 63) {
+            mask[nWords - 1] = (1ull << (n & 63)) - 1;
+        }
+        return;
+    }
+
+    selectKernel().func(row, n, (uint16_t)isoLevel, mask);
+}
+
+void ClassifyRow(const float *row, uint64_t n, float isoLevel, uint64_t *mask) {
+    std::memset(mask, 0, sizeof(uint64_t) * RowMaskWords(n));
+    if (n == 0) {
+        return;
+    }
+
+    selectKernel().floatFunc(row, n, isoLevel, mask);
+}
+
+void ClassifyCells(const uint64_t *m00, const uint64_t *m10, const uint64_t *m01, const uint64_t *m11,
+                   uint64_t nCells, uint64_t *active, uint8_t *cases) {
+    // Rows have "nCells + 1" voxels, so that the masks at "x + 1" are obtained by
+    // shifting the masks and carrying the lowest bit of the next word.
+    const uint64_t nWords = RowMaskWords(nCells);
+    const uint64_t nVoxelWords = RowMaskWords(nCells + 1);
+    for (uint64_t w = 0; w < nWords; w++) {
+        const bool next = w + 1 < nVoxelWords;
+        const uint64_t a00 = m00[w], b00 = (a00 >> 1) | (next ? m00[w + 1] << 63 : 0);
+        const uint64_t a10 = m10[w], b10 = (a10 >> 1) | (next ? m10[w + 1] << 63 : 0);
+        const uint64_t a01 = m01[w], b01 = (a01 >> 1) | (next ? m01[w + 1] << 63 : 0);
+        const uint64_t a11 = m11[w], b11 = (a11 >> 1) | (next ? m11[w + 1] << 63 : 0);
+
+        const uint64_t anyIn = a00 | b00 | a10 | b10 | a01 | b01 | a11 | b11;
+        const uint64_t allIn = a00 & b00 & a10 & b10 & a01 & b01 & a11 & b11;
+        uint64_t bits = anyIn & ~allIn;
+        if (w == nWords - 1 && (nCells & 63)) {
+            bits &= (1ull << (nCells & 63)) - 1;
+        }
+        active[w] = bits;
+
+        // Vertex order follows "cubeVertexOffsets"
+        while (bits) {
+            const int i = LowestBit(bits);
+            bits &= bits - 1;
+            cases[w * 64 + i] = (uint8_t)(((a00 >> i) & 1) << 0 | ((b00 >> i) & 1) << 1 |
+                                          ((b01 >> i) & 1) << 2 | ((a01 >> i) & 1) << 3 |
+                                          ((a10 >> i) & 1) << 4 | ((b10 >> i) & 1) << 5 |
+                                          ((b11 >> i) & 1) << 6 | ((a11 >> i) & 1) << 7);
+        }
+    }
+}
+
+void CrossingRowEdges(const uint64_t *mask, uint64_t nEdges, uint64_t *crossing) {
+    const uint64_t nWords = RowMaskWords(nEdges);
+    const uint64_t nVoxelWords = RowMaskWords(nEdges + 1);
+    for (uint64_t w = 0; w < nWords; w++) {
+        const uint64_t shifted = (mask[w] >> 1) | (w + 1 < nVoxelWords ? mask[w + 1] << 63 : 0);
+        crossing[w] = mask[w] ^ shifted;
+    }
+    if (nEdges & 63) {
+        crossing[nWords - 1] &= (1ull << (nEdges & 63)) - 1;
+    }
+}
+
+void CrossingRowPairs(const uint64_t *mask0, const uint64_t *mask1, uint64_t n, uint64_t *crossing) {
+    const uint64_t nWords = RowMaskWords(n);
+    for (uint64_t w = 0; w < nWords; w++) {
+        crossing[w] = mask0[w] ^ mask1[w];
+    }
+    if (n & 63) {
+        crossing[nWords - 1] &= (1ull << (n & 63)) - 1;
+    }
+}
+
+const char *ClassifyKernelName() {
+    return selectKernel().name;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Row classification kernels for iso-surface extraction.
+//
+// A row of voxels is classified into a bit mask whose x-th bit is set if the voxel
+// at x is inside (i.e., less than the iso-level). The comparisons are vectorized
+// with AVX2 or SSE2, and the kernel is chosen at runtime from the CPU features.
+// Cube cases of the cells between two adjacent rows and slices are then
+// obtained with bitwise operations on the masks of four rows.
+
+//! Number of 64-bit words for the bit mask of "n" voxels
+inline uint64_t RowMaskWords(uint64_t n) {
+    return (n + 63) / 64;
+}
+
+//! Index of the lowest set bit ("bits" must not be zero)
+inline int LowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+//! Set the x-th bit of "mask" if "row[x] < isoLevel" for the "n" voxels of the row.
+void ClassifyRow(const uint16_t *row, uint64_t n, uint32_t isoLevel, uint64_t *mask);
+void ClassifyRow(const float *row, uint64_t n, float isoLevel, uint64_t *mask);
+
+//! Cube cases of "nCells" cells spanned by the rows (y, z), (y + 1, z), (y, z + 1) and (y + 1, z + 1),
+//! whose masks are "m00", "m10", "m01" and "m11", respectively. The x-th bit of "active" is set
+//! if the x-th cell is cut by the iso-surface, and the cases are stored only for such cells.
+void ClassifyCells(const uint64_t *m00, const uint64_t *m10, const uint64_t *m01, const uint64_t *m11,
+                   uint64_t nCells, uint64_t *active, uint8_t *cases);
+
+//! Set the x-th bit of "crossing" if the voxels x and x + 1 of the row are on the different sides.
+void CrossingRowEdges(const uint64_t *mask, uint64_t nEdges, uint64_t *crossing);
+
+//! Set the x-th bit of "crossing" if the x-th voxels of the two rows are on the different sides.
+void CrossingRowPairs(const uint64_t *mask0, const uint64_t *mask1, uint64_t n, uint64_t *crossing);
+
+//! Name of the row classification kernel selected at runtime
+const char *ClassifyKernelName();
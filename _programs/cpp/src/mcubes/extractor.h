@@ -0,0 +1,394 @@
+#pragma once
+
+#include <cmath>
+#include <climits>
+#include <exception>
+#include <vector>
+#include <unordered_map>
+
+#include "common/vec3.h"
+#include "common/volume.h"
+#include "common/progress.h"
+#include "brick_tree.h"
+#include "classify.h"
+#include "mcubes_utils.h"
+
+// Cell-based extraction engine shared by the extractors whose output vertices lie on
+// segments between the corners of a cell (e.g., marching cubes and marching tetrahedra).
+//
+// A cell polygonizer only describes the topology of each of the 256 cube cases:
+//
+//     struct Polygonizer {
+//         static constexpr int maxTriangles = ...;
+//         // Write the triangles of the case, and return their number
+//         int operator()(int cubeindex, CellTriangle *triangles) const;
+//     };
+//
+// and the engine takes care of the traversal of the active cells, vertex interpolation,
+// welding and parallelization. The active spans are split into slabs (i.e., layers of bricks
+// along the z-axis), which are processed in parallel with their own output buffers. Vertices are
+// welded by the IDs of the grid edges they lie on, and the slabs are merged in order, so that
+// the output does not depend on the number of threads.
+
+//! Segment between two corners of a cell (numbered as "cubeVertexOffsets")
+struct CellEdge {
+    int8_t a, b;
+};
+
+struct CellTriangle {
+    CellEdge edges[3];
+};
+
+// Visit the cells cut by any of the iso-surfaces in the spans [first, last) with their cube indices.
+// Voxel rows of two adjacent rows and slices are classified at once by the SIMD kernels,
+// and the masks of the upper rows are reused for the next row of cells. Each voxel row is
+// loaded once and classified against all the iso-levels while it stays in the cache.
+template <typename T, typename Func>
+void forEachActiveCell(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks,
+                       const std::vector<BrickSpan> &spans, size_t first, size_t last,
+                       const std::vector<typename VoxelTraits<T>::IsoLevel> &isoLevels, Func func) {
+    // Row masks for each iso-level
+    struct RowMasks {
+        std::vector<uint64_t> m00, m10, m01, m11;
+    };
+
+    const uint64_t nWords = RowMaskWords(volume.size(0));
+    std::vector<RowMasks> masks(isoLevels.size());
+    for (auto &m : masks) {
+        m.m00.resize(nWords);
+        m.m10.resize(nWords);
+        m.m01.resize(nWords);
+        m.m11.resize(nWords);
+    }
+    std::vector<uint64_t> active(nWords);
+    std::vector<uint8_t> cases(volume.size(0));
+
+    for (size_t s = first; s < last; s++) {
+        const BrickSpan &span = spans[s];
+        const uint64_t x0 = bricks.cellBegin(span.begin, 0);
+        const uint64_t nCells = bricks.cellEnd(span.end - 1, 0) - x0;
+        const uint64_t y0 = bricks.cellBegin(span.y, 1);
+        for (uint64_t z = bricks.cellBegin(span.z, 2); z < bricks.cellEnd(span.z, 2); z++) {
+            for (size_t l = 0; l < isoLevels.size(); l++) {
+                ClassifyRow(volume.row(y0, z) + x0, nCells + 1, isoLevels[l], masks[l].m00.data());
+                ClassifyRow(volume.row(y0, z + 1) + x0, nCells + 1, isoLevels[l], masks[l].m01.data());
+            }
+            for (uint64_t y = y0; y < bricks.cellEnd(span.y, 1); y++) {
+                for (size_t l = 0; l < isoLevels.size(); l++) {
+                    RowMasks &m = masks[l];
+                    ClassifyRow(volume.row(y + 1, z) + x0, nCells + 1, isoLevels[l], m.m10.data());
+                    ClassifyRow(volume.row(y + 1, z + 1) + x0, nCells + 1, isoLevels[l], m.m11.data());
+                    ClassifyCells(m.m00.data(), m.m10.data(), m.m01.data(), m.m11.data(), nCells, active.data(),
+                                  cases.data());
+
+                    for (uint64_t w = 0; w < RowMaskWords(nCells); w++) {
+                        uint64_t bits = active[w];
+                        while (bits) {
+                            const uint64_t i = w * 64 + LowestBit(bits);
+                            bits &= bits - 1;
+                            func((int)l, x0 + i, y, z, (int)cases[i]);
+                        }
+                    }
+
+                    std::swap(m.m00, m.m10);
+                    std::swap(m.m01, m.m11);
+                }
+            }
+        }
+    }
+}
+
+// Single iso-level version of the above for all the spans
+template <typename T, typename Func>
+void forEachActiveCell(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks,
+                       const std::vector<BrickSpan> &spans, typename VoxelTraits<T>::IsoLevel isoLevel, Func func) {
+    using IsoLevel = typename VoxelTraits<T>::IsoLevel;
+    forEachActiveCell(volume, bricks, spans, 0, spans.size(), std::vector<IsoLevel>{ isoLevel },
+                      [&](int, uint64_t x, uint64_t y, uint64_t z, int cubeindex) { func(x, y, z, cubeindex); });
+}
+
+//! In-order hand-off of the slabs processed in parallel. When a slab is finished, it and the finished slabs
+//! after it are passed to "emit" in order as soon as all the slabs before them are finished. Only one thread
+//! emits at a time, while the others continue with the next slabs, so that only the slabs finished ahead of
+//! the oldest unfinished one are held in memory. An exception from "emit" stops the later emits, and is
+//! thrown again by "rethrow" after the parallel loop.
+class SlabHandoff {
+public:
+    explicit SlabHandoff(size_t nSlabs)
+        : finished(nSlabs, 0) {
+    }
+
+    template <typename Emit>
+    void finish(size_t s, const Emit &emit) {
+        bool drain = false;
+        #ifdef _OPENMP
+        #pragma omp critical(SlabHandoff)
+        #endif
+        {
+            finished[s] = 1;
+            if (!draining) {
+                draining = true;
+                drain = true;
+            }
+        }
+
+        while (drain) {
+            size_t slab = finished.size();
+            #ifdef _OPENMP
+            #pragma omp critical(SlabHandoff)
+            #endif
+            {
+                if (next < finished.size() && finished[next]) {
+                    slab = next++;
+                } else {
+                    draining = false;
+                    drain = false;
+                }
+            }
+            if (slab < finished.size() && !error) {
+                try {
+                    emit(slab);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    void rethrow() const {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    std::vector<uint8_t> finished;
+    size_t next = 0;
+    bool draining = false;
+    std::exception_ptr error;
+};
+
+namespace extractor_detail {
+
+//! Corners of a triangle vertex ordered so that "offset(hi) - offset(lo)" has no negative component.
+//! "dir" holds the bits of the difference, and is zero when the vertex is snapped to a corner.
+struct EdgeCase {
+    uint8_t lo, hi, dir;
+};
+
+//! Triangles of the 256 cube cases, built once for each polygonizer
+template <typename Polygonizer, bool FlipFaces>
+struct CaseTable {
+    EdgeCase vertices[256][Polygonizer::maxTriangles * 3];
+    int count[256];
+
+    CaseTable() {
+        const Polygonizer polygonizer;
+        CellTriangle triangles[Polygonizer::maxTriangles];
+        for (int c = 0; c < 256; c++) {
+            count[c] = polygonizer(c, triangles);
+            for (int i = 0; i < count[c]; i++) {
+                for (int j = 0; j < 3; j++) {
+                    const CellEdge &e = triangles[i].edges[FlipFaces ? 2 - j : j];
+                    const int *oa = cubeVertexOffsets[e.a];
+                    const int *ob = cubeVertexOffsets[e.b];
+                    const bool swap = oa[0] + oa[1] + oa[2] > ob[0] + ob[1] + ob[2];
+                    const int lo = swap ? e.b : e.a;
+                    const int hi = swap ? e.a : e.b;
+                    const int *ol = cubeVertexOffsets[lo];
+                    const int *oh = cubeVertexOffsets[hi];
+                    const int dir = (oh[0] - ol[0]) | (oh[1] - ol[1]) << 1 | (oh[2] - ol[2]) << 2;
+                    vertices[c][i * 3 + j] = { (uint8_t)lo, (uint8_t)hi, (uint8_t)dir };
+                }
+            }
+        }
+    }
+
+    static const CaseTable &get() {
+        static const CaseTable table;
+        return table;
+    }
+};
+
+//! Output of a slab for one iso-level. Each vertex has the key of the grid edge it lies on.
+struct SlabMesh {
+    std::vector<Vec3> vertices;
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> indices;
+};
+
+//! Append the triangles of the cell at (x, y, z) to "mesh", where "val" are the values at the corners of the cell
+//! ordered as "cubeVertexOffsets". Vertices are welded through "uniqueVertices" by the keys of the grid edges
+//! they lie on, i.e., "edgeKey(x, y, z, dir)" of the lower end points.
+template <typename Table, typename T, typename EdgeKey>
+void polygonizeCell(const Table &table, int cubeindex, const T val[8], uint64_t x, uint64_t y, uint64_t z,
+                    double isolevel, const EdgeKey &edgeKey, std::unordered_map<uint64_t, uint32_t> *uniqueVertices,
+                    SlabMesh *mesh) {
+    using Traits = VoxelTraits<T>;
+    const int ntris = table.count[cubeindex];
+    const EdgeCase *cases = table.vertices[cubeindex];
+    for (int i = 0; i < ntris; i++) {
+        uint32_t tri[3];
+        for (int j = 0; j < 3; j++) {
+            // Vertices snapped to a corner by "VertexInterp" are keyed by the corner
+            const EdgeCase &e = cases[i * 3 + j];
+            const double v0 = Traits::normalize(val[e.lo]);
+            const double v1 = Traits::normalize(val[e.hi]);
+            const int *o = cubeVertexOffsets[e.lo];
+            int dir = e.dir;
+            if (std::abs(isolevel - v0) < 0.00001) {
+                dir = 0;
+            } else if (std::abs(isolevel - v1) < 0.00001) {
+                o = cubeVertexOffsets[e.hi];
+                dir = 0;
+            } else if (std::abs(v0 - v1) < 0.00001) {
+                dir = 0;
+            }
+            const uint64_t key = edgeKey(x + o[0], y + o[1], z + o[2], dir);
+
+            const auto it = uniqueVertices->find(key);
+            if (it != uniqueVertices->end()) {
+                tri[j] = it->second;
+                continue;
+            }
+
+            const int *ol = cubeVertexOffsets[e.lo];
+            const int *oh = cubeVertexOffsets[e.hi];
+            const Vec3 p0(x + ol[0], y + ol[1], z + ol[2]);
+            const Vec3 p1(x + oh[0], y + oh[1], z + oh[2]);
+            tri[j] = static_cast<uint32_t>(mesh->vertices.size());
+            (*uniqueVertices)[key] = tri[j];
+            mesh->vertices.push_back(VertexInterp(isolevel, p0, p1, v0, v1));
+            mesh->keys.push_back(key);
+        }
+
+        if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
+            mesh->indices.push_back(tri[0]);
+            mesh->indices.push_back(tri[1]);
+            mesh->indices.push_back(tri[2]);
+        }
+    }
+}
+
+}  // namespace extractor_detail
+
+//! Extract one mesh per threshold from the cells of the active spans with "Polygonizer". The meshes are passed
+//! to "emit(level, vertices, nVerts, indices, nIndices)" slab by slab in order, where the indices refer to all
+//! the vertices emitted so far for the level. Each slab is emitted and released as soon as it and all the slabs
+//! before it are polygonized (see "SlabHandoff"), while the other slabs are still being polygonized.
+template <typename Polygonizer, bool FlipFaces, typename T, typename Emit>
+void extractCells(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks, const std::vector<BrickSpan> &spans,
+                  const std::vector<double> &thresholds, Emit emit) {
+    using namespace extractor_detail;
+    using Traits = VoxelTraits<T>;
+    const CaseTable<Polygonizer, FlipFaces> &table = CaseTable<Polygonizer, FlipFaces>::get();
+
+    const size_t nLevels = thresholds.size();
+    std::vector<typename Traits::IsoLevel> isoLevels(nLevels);
+    for (size_t l = 0; l < nLevels; l++) {
+        isoLevels[l] = Traits::isoLevel(thresholds[l]);
+    }
+
+    // Slabs of the spans, which are sorted by their brick rows
+    struct Slab {
+        uint64_t bz;
+        size_t first, last;
+        std::vector<SlabMesh> meshes;
+    };
+
+    std::vector<Slab> slabs;
+    for (size_t s = 0; s < spans.size(); s++) {
+        if (slabs.empty() || slabs.back().bz != spans[s].z) {
+            slabs.push_back({ spans[s].z, s, s, {} });
+        }
+        slabs.back().last = s + 1;
+    }
+
+    // Key of a grid edge from its lower voxel and the direction bits
+    const uint64_t sizeX = volume.size(0);
+    const uint64_t sizeXY = volume.size(0) * volume.size(1);
+    const auto edgeKey = [&](uint64_t x, uint64_t y, uint64_t z, int dir) -> uint64_t {
+        return ((z * sizeXY + y * sizeX + x) << 3) | dir;
+    };
+    const auto onPlane = [&](uint64_t key, uint64_t z) -> bool {
+        return (key >> 3) / sizeXY == z && (key & 0x04) == 0;
+    };
+
+    // Merge the slabs in order. Only the vertices on the plane between two adjacent
+    // slabs can be shared, and they are looked up from the ones of the previous slab.
+    std::vector<std::unordered_map<uint64_t, uint32_t>> planes(nLevels);
+    std::vector<uint32_t> nEmitted(nLevels, 0);
+    std::vector<uint32_t> remap;
+    std::vector<Vec3> newVertices;
+    std::vector<uint32_t> newIndices;
+    const auto emitSlab = [&](size_t s) {
+        const uint64_t z0 = bricks.cellBegin(slabs[s].bz, 2);
+        const uint64_t z1 = bricks.cellEnd(slabs[s].bz, 2);
+        const bool adjacent = s > 0 && slabs[s - 1].bz + 1 == slabs[s].bz;
+        for (size_t l = 0; l < nLevels; l++) {
+            const SlabMesh &mesh = slabs[s].meshes[l];
+            std::unordered_map<uint64_t, uint32_t> &plane = planes[l];
+
+            remap.resize(mesh.vertices.size());
+            newVertices.clear();
+            for (size_t i = 0; i < mesh.vertices.size(); i++) {
+                if (adjacent && onPlane(mesh.keys[i], z0)) {
+                    const auto it = plane.find(mesh.keys[i]);
+                    if (it != plane.end()) {
+                        remap[i] = it->second;
+                        continue;
+                    }
+                }
+                remap[i] = nEmitted[l] + static_cast<uint32_t>(newVertices.size());
+                newVertices.push_back(mesh.vertices[i]);
+            }
+
+            newIndices.resize(mesh.indices.size());
+            for (size_t i = 0; i < mesh.indices.size(); i++) {
+                newIndices[i] = remap[mesh.indices[i]];
+            }
+            emit(l, newVertices.data(), newVertices.size(), newIndices.data(), newIndices.size());
+            nEmitted[l] += static_cast<uint32_t>(newVertices.size());
+
+            plane.clear();
+            for (size_t i = 0; i < mesh.vertices.size(); i++) {
+                if (onPlane(mesh.keys[i], z1)) {
+                    plane[mesh.keys[i]] = remap[i];
+                }
+            }
+        }
+        slabs[s].meshes = std::vector<SlabMesh>();
+    };
+
+    // Polygonize the slabs in parallel, and hand them off to the merge in order
+    SlabHandoff handoff(slabs.size());
+    ProgressBar pbar((int)slabs.size());
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int64_t s = 0; s < (int64_t)slabs.size(); s++) {
+        Slab &slab = slabs[s];
+        slab.meshes.resize(nLevels);
+        std::vector<std::unordered_map<uint64_t, uint32_t>> uniqueVertices(nLevels);
+
+        T val[8];
+        forEachActiveCell(volume, bricks, spans, slab.first, slab.last, isoLevels,
+                          [&](int l, uint64_t x, uint64_t y, uint64_t z, int cubeindex) {
+            for (int i = 0; i < 8; i++) {
+                const int *d = cubeVertexOffsets[i];
+                val[i] = volume(x + d[0], y + d[1], z + d[2]);
+            }
+
+            polygonizeCell(table, cubeindex, val, x, y, z, thresholds[l], edgeKey, &uniqueVertices[l],
+                           &slab.meshes[l]);
+        });
+
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        pbar.step();
+
+        handoff.finish(s, emitSlab);
+    }
+    handoff.rethrow();
+}
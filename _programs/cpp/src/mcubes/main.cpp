@@ -1,4 +1,7 @@
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #include "common/path.h"
@@ -8,17 +11,37 @@
 
 int main(int argc, char **argv) {
     if (argc <= 4) {
-        fprintf(stderr, "[ USAGE ] march_cubes [ *.vol file ] [ width ] [ height ] [ dims ]");
+        fprintf(stderr, "[ USAGE ] march_cubes [ *.vol file ] [ width ] [ height ] [ dims ] [ thresholds (optional) ]\n");
+        fprintf(stderr, "  thresholds: comma-separated list such as \"0.2,0.45,0.7\" (Otsu's method if omitted)\n");
         std::exit(1);
     }
 
-    // Output path
+    // Thresholds (one mesh is extracted for each of them)
+    std::vector<double> thresholds;
+    if (argc > 5) {
+        std::istringstream iss(argv[5]);
+        std::string token;
+        while (std::getline(iss, token, ',')) {
+            thresholds.push_back(std::atof(token.c_str()));
+        }
+    }
+    if (thresholds.empty()) {
+        thresholds.push_back(-1.0);
+    }
+
+    // Output paths
     filepath path(argv[1]);
     const filepath dirname = path.dirname();
     const filepath basename = path.stem();
-    const std::string outfile = (dirname / basename + ".ply").string();
+    std::vector<std::string> outfiles;
+    for (size_t i = 0; i < thresholds.size(); i++) {
+        const std::string suffix = thresholds.size() > 1 ? "_" + std::to_string(i) : "";
+        outfiles.push_back((dirname / basename + suffix + ".ply").string());
+    }
     std::cout << " Input: " << argv[1] << std::endl;
-    std::cout << "Output: " << outfile << std::endl;
+    for (const auto &outfile : outfiles) {
+        std::cout << "Output: " << outfile << std::endl;
+    }
 
     // Load volume data
     const int sizeX = std::atoi(argv[2]);
@@ -27,14 +50,20 @@ int main(int argc, char **argv) {
     Volume vol(argv[1], sizeX, sizeY, sizeZ);
     printf("Size: %lld x %lld x %lld\n", vol.size(0), vol.size(1), vol.size(2));
 
-    // Marching cubes
-    std::vector<Vec3> positions;
-    std::vector<uint32_t> indices;
-    marchCubes(vol, &positions, &indices, -1.0, true);
-    //marchTets(vol, &positions, &indices, -1.0, true);
-    //dualContour(vol, &positions, &indices, -1.0, true);
+    // Marching cubes. Meshes are written to the files while they are extracted.
+    std::vector<std::unique_ptr<PlyStreamWriter>> writers;
+    std::vector<MeshSink *> sinks;
+    for (const auto &outfile : outfiles) {
+        writers.emplace_back(new PlyStreamWriter(outfile));
+        sinks.push_back(writers.back().get());
+    }
+    marchCubes(vol, thresholds, sinks, true);
+    //marchTets(vol, sinks[0], thresholds[0], true);
+    //surfaceNets(vol, sinks[0], thresholds[0], true);
 
-    // Write mesh data
-    write_ply(outfile, positions, indices);
-    printf("Saved to: %s\n", outfile.c_str());
+    // Finish mesh data
+    for (size_t i = 0; i < outfiles.size(); i++) {
+        writers[i]->close();
+        printf("Saved to: %s\n", outfiles[i].c_str());
+    }
 }
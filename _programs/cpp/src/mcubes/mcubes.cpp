@@ -2,538 +2,1295 @@
 
 #include <climits>
 #include <algorithm>
-#include <unordered_map>
-
-// {{
-#include <Eigen/Dense>
-// }}
 
 #include "common/array3d.h"
+#include "common/io.h"
 #include "common/progress.h"
+#include "brick_tree.h"
+#include "classify.h"
+#include "extractor.h"
 #include "mcubes_utils.h"
+#include "qef.h"
 
+// The histogram is cached in the volume, so that only the first call scans the voxels.
 double getThresholdOtsu(const Volume &volume) {
     // {{ NOT_IMPL_ERROR();
-    const double total = volume.size(0) * volume.size(1) * volume.size(2);
-    double hist[USHRT_MAX];
-    std::memset(hist, 0, sizeof(hist));
-    for (uint64_t z = 0; z < volume.size(2); z++) {
-        for (uint64_t y = 0; y < volume.size(1); y++) {
-            for (uint64_t x = 0; x < volume.size(0); x++) {
-                const uint16_t val = volume(x, y, z);
-                if (val != 0) {
-                    hist[val] += 1;
-                }
-            }
-        }
-    }
+    // Voxels with value zero are treated as background, and those less than the threshold form the lower class
+    const Histogram &hist = volume.histogram();
+    const int nBins = Histogram::numBins;
+    const double c = (double)hist.count(1, nBins);
+    const double s = (double)hist.sum(1, nBins);
 
-    double sum1 = 0.0;
-    double c1 = 0.0;
-    for (int i = 0; i < USHRT_MAX; i++) {
-        hist[i] /= total;
-        sum1 += hist[i] * i / (double)USHRT_MAX;
-        c1 += hist[i];
-    }
-
-    double sum2 = 0.0;
-    double c2 = 0.0;
     double maxVar = 0.0;
-    double threshold = 0.0;
-    for (int i = 0; i < USHRT_MAX; i++) {
-        const double mu1 = c1 != 0 ? sum1 / c1 : 0.0;
-        const double mu2 = c2 != 0 ? sum2 / c2 : 0.0;
+    int threshold = 0;
+    for (int t = 1; t < nBins; t++) {
+        const double c2 = (double)hist.count(1, t);
+        const double c1 = c - c2;
+        const double s2 = (double)hist.sum(1, t);
+        const double s1 = s - s2;
+        const double mu1 = c1 != 0 ? s1 / c1 : 0.0;
+        const double mu2 = c2 != 0 ? s2 / c2 : 0.0;
 
         const double diff = mu1 - mu2;
         const double var = c1 * c2 * diff * diff;
         if (maxVar < var) {
             maxVar = var;
-            threshold = i / (double)USHRT_MAX;
+            threshold = t;
         }
-
-        sum1 -= hist[i] * i / (double)USHRT_MAX;
-        c1 -= hist[i];
-        sum2 += hist[i] * i / (double)USHRT_MAX;
-        c2 += hist[i];
     }
 
-    return threshold;
+    return threshold / (double)USHRT_MAX;
     // }}
 }
 
 void marchCubes(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
-    // Clear arrays
-    vertices->clear();
-    indices->clear();
+    const BrickTree bricks(volume);
+    marchCubes(volume, bricks, vertices, indices, threshold, flipFaces);
+}
+
+// Thresholds of "Volume" are replaced with the one by Otsu's method if negative. Those of "FloatVolume" are
+// used as they are, but are rounded to float, so that the interpolation agrees with the classification.
+static double resolveThreshold(const Volume &volume, double threshold) {
+    return threshold < 0.0 ? getThresholdOtsu(volume) : threshold;
+}
+
+static double resolveThreshold(const FloatVolume &, double threshold) {
+    return (float)threshold;
+}
+
+// Collect the runs of bricks active for any of the iso-levels, and report how many bricks are active.
+template <typename T>
+static void findActiveSpans(const BasicBrickTree<T> &bricks,
+                            const std::vector<typename VoxelTraits<T>::IsoLevel> &isoLevels,
+                            std::vector<BrickSpan> *spans) {
+    bricks.activeSpans(isoLevels, spans);
+    uint64_t nActive = 0;
+    for (const auto &span : *spans) {
+        nActive += span.end - span.begin;
+    }
+    printf("Active bricks: %d / %d\n", (int)nActive, (int)bricks.totalBricks());
+}
+
+template <typename T>
+static void findActiveSpans(const BasicBrickTree<T> &bricks, typename VoxelTraits<T>::IsoLevel isoLevel,
+                            std::vector<BrickSpan> *spans) {
+    findActiveSpans(bricks, std::vector<typename VoxelTraits<T>::IsoLevel>{ isoLevel }, spans);
+}
+
+// Topology of the cube cases for marching cubes
+struct CubePolygonizer {
+    static constexpr int maxTriangles = 5;
+
+    int operator()(int cubeindex, CellTriangle *triangles) const {
+        // {{ NOT_IMPL_ERROR();
+        int ntriang = 0;
+        for (int i = 0; cubeTriTable[cubeindex][i] != -1; i += 3) {
+            for (int j = 0; j < 3; j++) {
+                const int e = cubeTriTable[cubeindex][i + j];
+                triangles[ntriang].edges[j] = { (int8_t)cubeEdgeVertices[e][0], (int8_t)cubeEdgeVertices[e][1] };
+            }
+            ntriang++;
+        }
+        return ntriang;
+        // }}
+    }
+};
+
+// Mesh sink which appends the batches to the arrays
+struct ArrayMeshSink : public MeshSink {
+    ArrayMeshSink(std::vector<Vec3> *vertices, std::vector<uint32_t> *indices)
+        : vertices(vertices)
+        , indices(indices) {
+        vertices->clear();
+        indices->clear();
+    }
+
+    void addVertices(const Vec3 *positions, size_t count) override {
+        vertices->insert(vertices->end(), positions, positions + count);
+    }
+
+    void addFaces(const uint32_t *faces, size_t nIndices) override {
+        indices->insert(indices->end(), faces, faces + nIndices);
+    }
+
+    std::vector<Vec3> *vertices;
+    std::vector<uint32_t> *indices;
+};
+
+// Resolve the thresholds, cull the bricks, and run the extraction engine with "Polygonizer".
+// The mesh of each threshold is passed to its sink as the slabs are merged.
+template <typename Polygonizer, typename T>
+static void extractMeshes(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks,
+                          const std::vector<double> &thresholds, const std::vector<MeshSink *> &sinks, bool flipFaces) {
+    if (sinks.size() != thresholds.size()) {
+        throw std::runtime_error("#thresholds and #sinks do not match!");
+    }
 
     // Compute threshold with Otsu's method, if threshold is not specified.
-    if (threshold < 0.0) {
-        threshold = getThresholdOtsu(volume);
+    std::vector<double> levels = thresholds;
+    for (double &threshold : levels) {
+        threshold = resolveThreshold(volume, threshold);
+        printf("Threshold: %.5f\n", threshold);
+    }
+
+    // Skip bricks which do not contain any of the iso-surfaces
+    std::vector<typename VoxelTraits<T>::IsoLevel> isoLevels(levels.size());
+    std::transform(levels.begin(), levels.end(), isoLevels.begin(), VoxelTraits<T>::isoLevel);
+    std::vector<BrickSpan> spans;
+    findActiveSpans(bricks, isoLevels, &spans);
+
+    std::vector<size_t> nVerts(levels.size(), 0), nFaces(levels.size(), 0);
+    const auto emit = [&](size_t l, const Vec3 *vertices, size_t count, const uint32_t *indices, size_t nIndices) {
+        sinks[l]->addVertices(vertices, count);
+        sinks[l]->addFaces(indices, nIndices);
+        nVerts[l] += count;
+        nFaces[l] += nIndices / 3;
+    };
+    if (flipFaces) {
+        extractCells<Polygonizer, true>(volume, bricks, spans, levels, emit);
+    } else {
+        extractCells<Polygonizer, false>(volume, bricks, spans, levels, emit);
+    }
+
+    for (size_t l = 0; l < levels.size(); l++) {
+        printf("#vert: %d\n", (int)nVerts[l]);
+        printf("#face: %d\n", (int)nFaces[l]);
     }
+}
+
+// Same as above, but the meshes are returned as arrays
+template <typename Polygonizer, typename T>
+static void extractMeshes(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks,
+                          const std::vector<double> &thresholds, std::vector<std::vector<Vec3>> *vertices,
+                          std::vector<std::vector<uint32_t>> *indices, bool flipFaces) {
+    vertices->assign(thresholds.size(), std::vector<Vec3>());
+    indices->assign(thresholds.size(), std::vector<uint32_t>());
+    std::vector<ArrayMeshSink> arrays;
+    std::vector<MeshSink *> sinks;
+    arrays.reserve(thresholds.size());
+    for (size_t l = 0; l < thresholds.size(); l++) {
+        arrays.emplace_back(&(*vertices)[l], &(*indices)[l]);
+        sinks.push_back(&arrays.back());
+    }
+    extractMeshes<Polygonizer>(volume, bricks, thresholds, sinks, flipFaces);
+}
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    ArrayMeshSink sink(vertices, indices);
+    extractMeshes<CubePolygonizer>(volume, bricks, { threshold }, { &sink }, flipFaces);
+}
+
+void marchCubes(const Volume &volume, const std::vector<double> &thresholds, std::vector<std::vector<Vec3>> *vertices,
+                std::vector<std::vector<uint32_t>> *indices, bool flipFaces) {
+    const BrickTree bricks(volume);
+    marchCubes(volume, bricks, thresholds, vertices, indices, flipFaces);
+}
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, const std::vector<double> &thresholds,
+                std::vector<std::vector<Vec3>> *vertices, std::vector<std::vector<uint32_t>> *indices,
+                bool flipFaces) {
+    extractMeshes<CubePolygonizer>(volume, bricks, thresholds, vertices, indices, flipFaces);
+}
+
+void marchCubes(const Volume &volume, const std::vector<double> &thresholds, const std::vector<MeshSink *> &sinks,
+                bool flipFaces) {
+    const BrickTree bricks(volume);
+    marchCubes(volume, bricks, thresholds, sinks, flipFaces);
+}
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, const std::vector<double> &thresholds,
+                const std::vector<MeshSink *> &sinks, bool flipFaces) {
+    extractMeshes<CubePolygonizer>(volume, bricks, thresholds, sinks, flipFaces);
+}
+
+void marchCubes(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                double threshold, bool flipFaces) {
+    const FloatBrickTree bricks(volume);
+    marchCubes(volume, bricks, vertices, indices, threshold, flipFaces);
+}
+
+void marchCubes(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    ArrayMeshSink sink(vertices, indices);
+    extractMeshes<CubePolygonizer>(volume, bricks, { threshold }, { &sink }, flipFaces);
+}
+
+void marchCubes(const FloatVolume &volume, const FloatBrickTree &bricks, const std::vector<double> &thresholds,
+                const std::vector<MeshSink *> &sinks, bool flipFaces) {
+    extractMeshes<CubePolygonizer>(volume, bricks, thresholds, sinks, flipFaces);
+}
+
+// Bricks of the lattice for the lazy extraction, which have as many cells as those of "BrickTree"
+static const uint64_t implicitBrickSize = 8;
+
+// The bricks are visited in waves, each of which evaluates and polygonizes its bricks in parallel. The cells on the
+// faces of a brick are shared with the next brick, so that the surface cutting them continues into the next brick.
+// The meshes of the bricks are merged in the order of the brick IDs, and the vertices on the faces of the bricks are
+// welded by the keys of their grid edges, so that the output does not depend on the number of threads.
+template <bool FlipFaces>
+static void extractImplicit(const ImplicitFunction &func, const std::array<uint64_t, 3> &sizes,
+                            const std::vector<Vec3> &seeds, double threshold, std::vector<Vec3> *vertices,
+                            std::vector<uint32_t> *indices) {
+    using namespace extractor_detail;
+    const CaseTable<CubePolygonizer, FlipFaces> &table = CaseTable<CubePolygonizer, FlipFaces>::get();
+
+    vertices->clear();
+    indices->clear();
+    threshold = (float)threshold;
     printf("Threshold: %.5f\n", threshold);
+    const float isoLevel = VoxelTraits<float>::isoLevel(threshold);
+
+    const uint64_t B = implicitBrickSize;
+    std::array<uint64_t, 3> nBricks;
+    for (int i = 0; i < 3; i++) {
+        nBricks[i] = sizes[i] > 1 ? (sizes[i] - 2) / B + 1 : 0;
+    }
+    const uint64_t totalBricks = nBricks[0] * nBricks[1] * nBricks[2];
+    if (totalBricks == 0) {
+        return;
+    }
+
+    const uint64_t sizeX = sizes[0];
+    const uint64_t sizeXY = sizes[0] * sizes[1];
+    const auto edgeKey = [&](uint64_t x, uint64_t y, uint64_t z, int dir) -> uint64_t {
+        return ((z * sizeXY + y * sizeX + x) << 3) | dir;
+    };
+
+    // Bricks containing the cells within one cell from the seeds
+    std::vector<uint8_t> visited(totalBricks, 0);
+    std::vector<uint64_t> front;
+    for (const auto &p : seeds) {
+        uint64_t lo[3], hi[3];
+        for (int i = 0; i < 3; i++) {
+            const int64_t maxCell = (int64_t)sizes[i] - 2;
+            const int64_t cell = (int64_t)std::floor(p[i]);
+            lo[i] = (uint64_t)std::max((int64_t)0, std::min(cell - 1, maxCell)) / B;
+            hi[i] = (uint64_t)std::max((int64_t)0, std::min(cell + 1, maxCell)) / B;
+        }
+        for (uint64_t bz = lo[2]; bz <= hi[2]; bz++) {
+            for (uint64_t by = lo[1]; by <= hi[1]; by++) {
+                for (uint64_t bx = lo[0]; bx <= hi[0]; bx++) {
+                    const uint64_t id = (bz * nBricks[1] + by) * nBricks[0] + bx;
+                    if (!visited[id]) {
+                        visited[id] = 1;
+                        front.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+
+    // Mesh of a brick, and the bit mask of the faces (-x, +x, -y, +y, -z, +z) cut by the surface
+    struct BrickMesh {
+        uint64_t id;
+        SlabMesh mesh;
+        int exits;
+    };
+
+    std::vector<BrickMesh> meshes;
+    uint64_t nVisited = 0;
+    while (!front.empty()) {
+        std::sort(front.begin(), front.end());
+        std::vector<BrickMesh> wave(front.size());
+
+        #ifdef _OPENMP
+        #pragma omp parallel
+        #endif
+        {
+            std::vector<Vec3> points;
+            std::vector<float> values;
+            std::unordered_map<uint64_t, uint32_t> uniqueVertices;
 
-    // Marching cubes
-    GRIDCELL cell;
-    TRIANGLE tris[16];
-    const Vec3 resolution = Vec3(1.0, 1.0, 1.0);
-
-    // See: "http://paulbourke.net/geometry/polygonise/"
-    // Vertex ordering in the cube is rather wired, and
-    // the array below re-orders the vertices for easy bit masking.
-    static int indexTable[8] = { 0, 1, 4, 5, 3, 2, 7, 6 };
-
-    ProgressBar pbar((volume.size(1) - 1) * (volume.size(2) - 1));
-    std::unordered_map<Vec3, uint32_t> uniqueVertices;
-    for (uint64_t z = 0; z < volume.size(2) - 1; z++) {
-        for (uint64_t y = 0; y < volume.size(1) - 1; y++) {
-            for (uint64_t x = 0; x < volume.size(0) - 1; x++) {
-                // {{ NOT_IMPL_ERROR();
-                for (int i = 0; i < 8; i++) {
-                    const int dx = (i >> 0) & 0x01;
-                    const int dy = (i >> 1) & 0x01;
-                    const int dz = (i >> 2) & 0x01;
-                    cell.p[indexTable[i]] = Vec3(x + dx, y + dy, z + dz) * resolution;
-                    cell.val[indexTable[i]] = volume(x + dx, y + dy, z + dz) / (double)USHRT_MAX;
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+            #endif
+            for (int64_t f = 0; f < (int64_t)front.size(); f++) {
+                const uint64_t id = front[f];
+                const uint64_t b[3] = { id % nBricks[0], (id / nBricks[0]) % nBricks[1],
+                                        id / (nBricks[0] * nBricks[1]) };
+                uint64_t lo[3], n[3];
+                for (int i = 0; i < 3; i++) {
+                    lo[i] = b[i] * B;
+                    n[i] = std::min(lo[i] + B, sizes[i] - 1) - lo[i] + 1;
                 }
 
-                std::fill(tris, tris + 16, TRIANGLE());
-                const int ntris = Polygonise(cell, threshold, tris);
-
-                for (int i = 0; i < ntris; i++) {
-                    uint32_t tri[3];
-                    for (int j = 0; j < 3; j++) {
-                        const int k = flipFaces ? 2 - j : j;
-                        const Vec3 &v = tris[i].p[k];
-                        if (uniqueVertices.count(v) == 0) {
-                            uniqueVertices[v] = static_cast<uint32_t>(vertices->size());
-                            vertices->push_back(v);
+                // Values at the lattice points of the brick
+                points.clear();
+                for (uint64_t z = 0; z < n[2]; z++) {
+                    for (uint64_t y = 0; y < n[1]; y++) {
+                        for (uint64_t x = 0; x < n[0]; x++) {
+                            points.emplace_back(lo[0] + x, lo[1] + y, lo[2] + z);
                         }
-                        tri[j] = uniqueVertices[v];
                     }
+                }
+                values.resize(points.size());
+                func(points.data(), points.size(), values.data());
 
-                    if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
-                        indices->push_back(tri[0]);
-                        indices->push_back(tri[1]);
-                        indices->push_back(tri[2]);
+                BrickMesh &brick = wave[f];
+                brick.id = id;
+                brick.exits = 0;
+                uniqueVertices.clear();
+                float val[8];
+                for (uint64_t z = 0; z < n[2] - 1; z++) {
+                    for (uint64_t y = 0; y < n[1] - 1; y++) {
+                        for (uint64_t x = 0; x < n[0] - 1; x++) {
+                            int cubeindex = 0;
+                            for (int i = 0; i < 8; i++) {
+                                const int *d = cubeVertexOffsets[i];
+                                val[i] = values[((z + d[2]) * n[1] + (y + d[1])) * n[0] + (x + d[0])];
+                                cubeindex |= (val[i] < isoLevel ? 1 : 0) << i;
+                            }
+                            if (cubeindex == 0 || cubeindex == 0xff) {
+                                continue;
+                            }
+
+                            const uint64_t c[3] = { x, y, z };
+                            for (int i = 0; i < 3; i++) {
+                                brick.exits |= (c[i] == 0 ? 1 : 0) << (i * 2);
+                                brick.exits |= (c[i] == n[i] - 2 ? 1 : 0) << (i * 2 + 1);
+                            }
+                            polygonizeCell(table, cubeindex, val, lo[0] + x, lo[1] + y, lo[2] + z, threshold,
+                                           edgeKey, &uniqueVertices, &brick.mesh);
+                        }
                     }
                 }
-                // }}
             }
-            pbar.step();
+        }
+
+        // Next bricks which the surface passes into
+        nVisited += front.size();
+        front.clear();
+        for (auto &brick : wave) {
+            const uint64_t b[3] = { brick.id % nBricks[0], (brick.id / nBricks[0]) % nBricks[1],
+                                    brick.id / (nBricks[0] * nBricks[1]) };
+            for (int k = 0; k < 6; k++) {
+                const int axis = k / 2;
+                const bool upper = (k % 2) != 0;
+                if (!(brick.exits & (1 << k)) || (!upper && b[axis] == 0) || (upper && b[axis] + 1 >= nBricks[axis])) {
+                    continue;
+                }
+
+                const uint64_t step = axis == 0 ? 1 : axis == 1 ? nBricks[0] : nBricks[0] * nBricks[1];
+                const uint64_t next = upper ? brick.id + step : brick.id - step;
+                if (!visited[next]) {
+                    visited[next] = 1;
+                    front.push_back(next);
+                }
+            }
+
+            if (!brick.mesh.vertices.empty()) {
+                meshes.push_back(std::move(brick));
+            }
         }
     }
+    printf("Visited bricks: %d / %d (active: %d)\n", (int)nVisited, (int)totalBricks, (int)meshes.size());
+
+    // Merge the bricks in order. Only the vertices on the faces of the bricks can be shared.
+    std::sort(meshes.begin(), meshes.end(), [](const BrickMesh &a, const BrickMesh &b) { return a.id < b.id; });
+    const auto onBrickFace = [&](uint64_t key) -> bool {
+        const uint64_t v = key >> 3;
+        const uint64_t c[3] = { v % sizeX, (v / sizeX) % sizes[1], v / sizeXY };
+        for (int i = 0; i < 3; i++) {
+            if (c[i] % B == 0 && (key & (1ull << i)) == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::unordered_map<uint64_t, uint32_t> shared;
+    std::vector<uint32_t> remap;
+    for (auto &brick : meshes) {
+        const SlabMesh &mesh = brick.mesh;
+        remap.resize(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            if (onBrickFace(mesh.keys[i])) {
+                const auto it = shared.find(mesh.keys[i]);
+                if (it != shared.end()) {
+                    remap[i] = it->second;
+                    continue;
+                }
+                shared[mesh.keys[i]] = static_cast<uint32_t>(vertices->size());
+            }
+            remap[i] = static_cast<uint32_t>(vertices->size());
+            vertices->push_back(mesh.vertices[i]);
+        }
+
+        for (uint32_t v : mesh.indices) {
+            indices->push_back(remap[v]);
+        }
+        brick.mesh = SlabMesh();
+    }
 
     printf("#vert: %d\n", (int)vertices->size());
     printf("#face: %d\n", (int)indices->size() / 3);
 }
 
+void marchCubes(const ImplicitFunction &func, const std::array<uint64_t, 3> &sizes, const std::vector<Vec3> &seeds,
+                std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    if (flipFaces) {
+        extractImplicit<true>(func, sizes, seeds, threshold, vertices, indices);
+    } else {
+        extractImplicit<false>(func, sizes, seeds, threshold, vertices, indices);
+    }
+}
+
 // {{
 
 void marchTets(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
-    // Clear arrays
-    vertices->clear();
-    indices->clear();
+    const BrickTree bricks(volume);
+    marchTets(volume, bricks, vertices, indices, threshold, flipFaces);
+}
 
-    // Compute threshold with Otsu's method, if threshold is not specified.
-    if (threshold < 0.0) {
-        threshold = getThresholdOtsu(volume);
+// Topology of the cube cases for marching tetrahedra, where the cube is split into
+// six tetrahedra sharing the diagonal between the vertices 0 and 6.
+struct TetPolygonizer {
+    static constexpr int maxTriangles = 12;
+
+    int operator()(int cubeindex, CellTriangle *triangles) const {
+        // See: "http://paulbourke.net/geometry/polygonise/"
+        static const int tetsTable[6][4] = {
+                { 6, 0, 5, 1 }, { 6, 0, 4, 5 },
+                { 6, 2, 0, 1 }, { 6, 0, 7, 4 },
+                { 6, 2, 3, 0 }, { 6, 0, 3, 7 }
+        };
+        // End points of the tetrahedron edges as used in "PolygonizeTet"
+        static const int tetEdgeVertices[6][2] = {
+                { 0, 1 }, { 0, 2 }, { 0, 3 }, { 1, 2 }, { 2, 3 }, { 1, 3 }
+        };
+
+        int ntriang = 0;
+        for (int t = 0; t < 6; t++) {
+            int tetindex = 0;
+            for (int j = 0; j < 4; j++) {
+                tetindex |= ((cubeindex >> tetsTable[t][j]) & 0x01) << j;
+            }
+
+            for (int i = 0; tetTriTable[tetindex][i] != -1; i += 3) {
+                for (int j = 0; j < 3; j++) {
+                    const int *e = tetEdgeVertices[tetTriTable[tetindex][i + j]];
+                    triangles[ntriang].edges[j] = { (int8_t)tetsTable[t][e[0]], (int8_t)tetsTable[t][e[1]] };
+                }
+                ntriang++;
+            }
+        }
+        return ntriang;
     }
-    printf("Threshold: %.5f\n", threshold);
+};
+
+void marchTets(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+               std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    ArrayMeshSink sink(vertices, indices);
+    extractMeshes<TetPolygonizer>(volume, bricks, { threshold }, { &sink }, flipFaces);
+}
+
+void marchTets(const Volume &volume, MeshSink *sink, double threshold, bool flipFaces) {
+    const BrickTree bricks(volume);
+    marchTets(volume, bricks, sink, threshold, flipFaces);
+}
+
+void marchTets(const Volume &volume, const BrickTree &bricks, MeshSink *sink, double threshold, bool flipFaces) {
+    extractMeshes<TetPolygonizer>(volume, bricks, { threshold }, { sink }, flipFaces);
+}
+
+void marchTets(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+               double threshold, bool flipFaces) {
+    const FloatBrickTree bricks(volume);
+    marchTets(volume, bricks, vertices, indices, threshold, flipFaces);
+}
+
+void marchTets(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+               std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    ArrayMeshSink sink(vertices, indices);
+    extractMeshes<TetPolygonizer>(volume, bricks, { threshold }, { &sink }, flipFaces);
+}
+
+// Normalized central differences (one-sided at the borders) of the voxels [x0, x0 + n) in the row (y, z).
+// The stencil is separable, so that each component is computed over the row and its neighboring rows
+// in a loop without branches, and normalized afterwards.
+template <typename T>
+static void gradientRow(const BasicVolume<T> &volume, int64_t x0, int64_t n, int64_t y, int64_t z, bool flipFaces,
+                        Vec3 *normals) {
+    const int64_t sizeX = volume.size(0);
+    const int64_t y0 = std::max((int64_t)0, y - 1);
+    const int64_t y1 = std::min(y + 1, (int64_t)volume.size(1) - 1);
+    const int64_t z0 = std::max((int64_t)0, z - 1);
+    const int64_t z1 = std::min(z + 1, (int64_t)volume.size(2) - 1);
+    const T *row = volume.row(y, z);
+    const T *rowY0 = volume.row(y0, z);
+    const T *rowY1 = volume.row(y1, z);
+    const T *rowZ0 = volume.row(y, z0);
+    const T *rowZ1 = volume.row(y, z1);
+    const auto value = [](T v) { return VoxelTraits<T>::normalize(v); };
+
+    std::vector<double> gx(n), gy(n), gz(n);
+    for (int64_t i = 0; i < n; i++) {
+        const int64_t x = x0 + i;
+        const int64_t xa = std::max((int64_t)0, x - 1);
+        const int64_t xb = std::min(x + 1, sizeX - 1);
+        gx[i] = (value(row[xb]) - value(row[xa])) / (double)(xb - xa);
+        gy[i] = (value(rowY1[x]) - value(rowY0[x])) / (double)(y1 - y0);
+        gz[i] = (value(rowZ1[x]) - value(rowZ0[x])) / (double)(z1 - z0);
+    }
+
+    for (int64_t i = 0; i < n; i++) {
+        if (gx[i] != 0.0 || gy[i] != 0.0 || gz[i] != 0.0) {
+            normals[i] = normalize(Vec3(gx[i], gy[i], gz[i])) * (flipFaces ? -1.0 : 1.0);
+        } else {
+            normals[i] = Vec3(0.0, 0.0, 0.0);
+        }
+    }
+}
 
-    // Marching tetrahedra
-    GRIDCELL cell;
-    TETRAHEDRON tet;
-    TRIANGLE tris[2];
-    const Vec3 resolution = Vec3(1.0, 1.0, 1.0);
-
-    // See: "http://paulbourke.net/geometry/polygonise/"
-    // Vertex ordering in the cube is rather wired, and
-    // the array below re-orders the vertices for easy bit masking.
-    static int indexTable[8] = { 0, 1, 4, 5, 3, 2, 7, 6 };
-    static const int tetsTable[6][4] = {
-            { 6, 0, 5, 1 }, { 6, 0, 4, 5 },
-            { 6, 2, 0, 1 }, { 6, 0, 7, 4 },
-            { 6, 2, 3, 0 }, { 6, 0, 3, 7 }
+// Active cell of dual contouring with the QEF of its crossing edges and its vertex
+struct ActiveCell {
+    uint64_t id;
+    QEF qef;
+    Vec3 p;
+};
+
+// Simplify the active cells with an octree over the cell grid. The QEFs of eight children are merged
+// into their parent when all the children are collapsed, and the parent is collapsed if the minimizer
+// of the merged QEF stays in the node and its residual is at most "tolerance". Each active cell is then
+// represented by the vertex of its highest collapsed ancestor, whose index is stored in "groups".
+template <typename T>
+static void simplifyCells(const BasicVolume<T> &volume, const std::vector<ActiveCell> &cells, double tolerance,
+                          std::vector<uint32_t> *groups, std::vector<Vec3> *positions) {
+    struct OctreeNode {
+        uint64_t x, y, z;
+        QEF qef;
+        Vec3 p;
+        bool collapsed;
     };
 
-    ProgressBar pbar((volume.size(1) - 1) * (volume.size(2) - 1));
-    std::unordered_map<Vec3, uint32_t> uniqueVertices;
-    for (uint64_t z = 0; z < volume.size(2) - 1; z++) {
-        for (uint64_t y = 0; y < volume.size(1) - 1; y++) {
-            for (uint64_t x = 0; x < volume.size(0) - 1; x++) {
-                for (int i = 0; i < 8; i++) {
-                    const int dx = (i >> 0) & 0x01;
-                    const int dy = (i >> 1) & 0x01;
-                    const int dz = (i >> 2) & 0x01;
-                    cell.p[indexTable[i]] = Vec3(x + dx, y + dy, z + dz) * resolution;
-                    cell.val[indexTable[i]] = volume(x + dx, y + dy, z + dz) / (double)USHRT_MAX;
-                }
+    // Leaves are the active cells, which are always collapsed
+    std::vector<std::vector<OctreeNode>> levels(1);
+    std::vector<std::vector<uint32_t>> parents;
+    const uint64_t sizeX = volume.size(0);
+    const uint64_t sizeXY = volume.size(0) * volume.size(1);
+    for (const auto &c : cells) {
+        levels[0].push_back({ c.id % sizeX, (c.id / sizeX) % volume.size(1), c.id / sizeXY, c.qef, c.p, true });
+    }
 
-                for (int t = 0; t < 6; t++) {
-                    for (int j = 0; j < 4; j++) {
-                        tet.p[j] = cell.p[tetsTable[t][j]];
-                        tet.val[j] = cell.val[tetsTable[t][j]];
-                    }
+    std::array<uint64_t, 3> sizes = { volume.size(0) - 1, volume.size(1) - 1, volume.size(2) - 1 };
+    while (sizes[0] > 1 || sizes[1] > 1 || sizes[2] > 1) {
+        for (int i = 0; i < 3; i++) {
+            sizes[i] = (sizes[i] + 1) / 2;
+        }
 
-                    std::fill(tris, tris + 16, TRIANGLE());
-                    const int ntris = PolygonizeTet(tet, threshold, tris);
-
-                    for (int i = 0; i < ntris; i++) {
-                        uint32_t tri[3];
-                        for (int j = 0; j < 3; j++) {
-                            const int k = flipFaces ? 2 - j : j;
-                            const Vec3 &v = tris[i].p[k];
-                            if (uniqueVertices.count(v) == 0) {
-                                uniqueVertices[v] = static_cast<uint32_t>(vertices->size());
-                                vertices->push_back(v);
-                            }
-                            tri[j] = uniqueVertices[v];
-                        }
+        // Group the children by their parents
+        const std::vector<OctreeNode> &children = levels.back();
+        const auto parentKey = [&](const OctreeNode &n) -> uint64_t {
+            return ((n.z / 2) * sizes[1] + (n.y / 2)) * sizes[0] + (n.x / 2);
+        };
+        std::vector<uint32_t> order(children.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = (uint32_t)i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t i, uint32_t j) {
+            return parentKey(children[i]) < parentKey(children[j]);
+        });
 
-                        if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
-                            indices->push_back(tri[0]);
-                            indices->push_back(tri[1]);
-                            indices->push_back(tri[2]);
-                        }
-                    }
-                }
+        const int level = (int)levels.size();
+        const double nodeSize = (double)(1ull << level);
+        std::vector<OctreeNode> nodes;
+        std::vector<uint32_t> parentOf(children.size());
+        bool anyCollapsed = false;
+        for (size_t i = 0; i < order.size();) {
+            const OctreeNode &first = children[order[i]];
+            OctreeNode node = { first.x / 2, first.y / 2, first.z / 2, QEF(), Vec3(0.0), true };
+            size_t j = i;
+            for (; j < order.size() && parentKey(children[order[j]]) == parentKey(first); j++) {
+                const OctreeNode &child = children[order[j]];
+                node.qef += child.qef;
+                node.collapsed = node.collapsed && child.collapsed;
+                parentOf[order[j]] = (uint32_t)nodes.size();
             }
-            pbar.step();
+
+            if (node.collapsed) {
+                node.p = node.qef.count != 0 ? node.qef.solveAroundMassPoint() : first.p;
+                const Vec3 lo = Vec3(node.x, node.y, node.z) * nodeSize;
+                const Vec3 hi = lo + Vec3(nodeSize);
+                const bool inside = node.p.x >= lo.x && node.p.y >= lo.y && node.p.z >= lo.z &&
+                                    node.p.x <= hi.x && node.p.y <= hi.y && node.p.z <= hi.z;
+                node.collapsed = inside && node.qef.error(node.p) <= tolerance;
+            }
+            anyCollapsed = anyCollapsed || node.collapsed;
+            nodes.push_back(node);
+            i = j;
         }
+
+        if (!anyCollapsed) {
+            break;
+        }
+        levels.push_back(std::move(nodes));
+        parents.push_back(std::move(parentOf));
     }
 
-    printf("#vert: %d\n", (int)vertices->size());
-    printf("#face: %d\n", (int)indices->size() / 3);
+    // Find the highest collapsed ancestor of each cell, and number the representatives
+    std::vector<std::vector<int64_t>> ids(levels.size());
+    for (size_t k = 0; k < levels.size(); k++) {
+        ids[k].assign(levels[k].size(), -1);
+    }
+    groups->resize(cells.size());
+    positions->clear();
+    for (size_t i = 0; i < cells.size(); i++) {
+        size_t level = 0, node = i;
+        while (level + 1 < levels.size() && levels[level + 1][parents[level][node]].collapsed) {
+            node = parents[level][node];
+            level += 1;
+        }
+        if (ids[level][node] < 0) {
+            ids[level][node] = (int64_t)positions->size();
+            positions->push_back(levels[level][node].p);
+        }
+        (*groups)[i] = (uint32_t)ids[level][node];
+    }
 }
 
-void dualContour(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+// Dual contouring over the active cells, which are simplified with an octree if "tolerance" is not negative.
+template <typename T>
+static void dualContourImpl(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks,
+                            std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold,
+                            bool flipFaces, bool lazyGradients, double tolerance) {
+    using Traits = VoxelTraits<T>;
+
     // Clear arrays
     vertices->clear();
     indices->clear();
 
     // Compute threshold with Otsu's method, if threshold is not specified.
-    if (threshold < 0.0) {
-        threshold = getThresholdOtsu(volume);
-    }
+    threshold = resolveThreshold(volume, threshold);
     printf("Threshold: %.5f\n", threshold);
 
-    // Compute normals
-    Array3D<Vec3> normals(volume.size(0), volume.size(1), volume.size(2));
-    for (int64_t z = 0; z < (int64_t)volume.size(2); z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1); y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0); x++) {
-                const int64_t x0 = std::max(0ll, x - 1);
-                const int64_t x1 = std::min(x + 1, (int64_t)volume.size(0) - 1);
-                const int64_t y0 = std::max(0ll, y - 1);
-                const int64_t y1 = std::min(y + 1, (int64_t)volume.size(1) - 1);
-                const int64_t z0 = std::max(0ll, z - 1);
-                const int64_t z1 = std::min(z + 1, (int64_t)volume.size(2) - 1);
-                const double dx = ((volume(x1, y, z) / (double)USHRT_MAX) - (volume(x0, y, z) / (double)USHRT_MAX)) / (double)(x1 - x0);
-                const double dy = ((volume(x, y1, z) / (double)USHRT_MAX) - (volume(x, y0, z) / (double)USHRT_MAX)) / (double)(y1 - y0);
-                const double dz = ((volume(x, y, z1) / (double)USHRT_MAX) - (volume(x, y, z0) / (double)USHRT_MAX)) / (double)(z1 - z0);
-                if (dx != 0.0 || dy != 0.0 || dz != 0.0) {
-                    normals(x, y, z) = normalize(Vec3(dx, dy, dz)) * (flipFaces ? -1.0 : 1.0);
-                } else {
-                    normals(x, y, z) = Vec3(0.0, 0.0, 0.0);
+    // Skip bricks which do not contain the iso-surface. Each edge is processed
+    // by the brick owning its lower end point, and each cell by the brick containing it.
+    const typename Traits::IsoLevel isoLevel = Traits::isoLevel(threshold);
+    std::vector<BrickSpan> spans;
+    findActiveSpans(bricks, isoLevel, &spans);
+
+    // Compute normals for the voxels inside active bricks in advance, unless they
+    // are evaluated lazily for the end points of the crossing edges.
+    Array3D<Vec3> normals;
+    if (!lazyGradients) {
+        normals = Array3D<Vec3>(volume.size(0), volume.size(1), volume.size(2));
+        for (const auto &span : spans) {
+            const int64_t x0 = bricks.cellBegin(span.begin, 0);
+            const int64_t nVoxels = bricks.cellEnd(span.end - 1, 0) + 1 - x0;
+            for (int64_t z = bricks.cellBegin(span.z, 2); z <= (int64_t)bricks.cellEnd(span.z, 2); z++) {
+                for (int64_t y = bricks.cellBegin(span.y, 1); y <= (int64_t)bricks.cellEnd(span.y, 1); y++) {
+                    gradientRow(volume, x0, nVoxels, y, z, flipFaces, &normals(x0, y, z));
                 }
             }
         }
     }
 
-    // Check intersection between cube edges and iso-contours
-    Array3D<std::tuple<Vec3, Vec3>> edges[3];
-
-    // X axis
-    edges[0] = Array3D<std::tuple<Vec3, Vec3>>(volume.size(0) - 1, volume.size(1), volume.size(2));
-    for (int64_t z = 0; z < (int64_t)volume.size(2); z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1); y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0) - 1; x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x + 1, y, z) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    const Vec3 p0 = Vec3(x, y, z);
-                    const Vec3 p1 = Vec3(x + 1, y, z);
-                    const Vec3 p = VertexInterp(threshold, p0, p1, v0, v1);
-                    const Vec3 n0 = normals(x, y, z);
-                    const Vec3 n1 = normals(x + 1, y, z);
-                    const Vec3 n = normalize(std::abs(v1 - threshold) * n0 + std::abs(v0 - threshold) * n1);
-                    edges[0](x, y, z) = std::make_tuple(p, n);
+    // Edges and cells are identified by the linear index of their lower voxels.
+    const uint64_t sizeX = volume.size(0);
+    const uint64_t sizeXY = volume.size(0) * volume.size(1);
+    const auto voxelId = [&](int64_t x, int64_t y, int64_t z) -> uint64_t {
+        return z * sizeXY + y * sizeX + x;
+    };
+
+    // Check intersection between cube edges and iso-contours. Crossing edges are
+    // found from the inside masks of the voxel rows, and only they are stored
+    // with their intersection points and normals in the order of edge IDs.
+    struct CrossingEdge {
+        uint64_t id;  // voxel ID * 3 + axis
+        Vec3 p, n;
+    };
+    std::vector<CrossingEdge> crossings;
+
+    const uint64_t nWords = RowMaskWords(volume.size(0));
+    std::vector<uint64_t> mask(nWords), maskY(nWords), maskZ(nWords), crossing(nWords);
+    std::vector<std::vector<Vec3>> gradientRows;
+    std::vector<char> gradientValid;
+    for (const auto &span : spans) {
+        const int64_t x0 = bricks.voxelBegin(span.begin, 0);
+        const int64_t x1 = bricks.voxelEnd(span.end - 1, 0);
+        const int64_t nVoxels = std::min(x1 + 1, (int64_t)volume.size(0)) - x0;
+
+        // Gradient rows of the span, including the rows of the next bricks touched by the
+        // crossing edges. Each row is computed when one of its voxels is first needed.
+        const int64_t yb = bricks.voxelBegin(span.y, 1);
+        const int64_t zb = bricks.voxelBegin(span.z, 2);
+        const int64_t nRowsY = bricks.voxelEnd(span.y, 1) - yb + 1;
+        const int64_t nRowsZ = bricks.voxelEnd(span.z, 2) - zb + 1;
+        if (lazyGradients) {
+            gradientRows.resize(std::max(gradientRows.size(), (size_t)(nRowsY * nRowsZ)));
+            gradientValid.assign(nRowsY * nRowsZ, 0);
+        }
+        const auto normalAt = [&](int64_t x, int64_t y, int64_t z) -> const Vec3 & {
+            if (!lazyGradients) {
+                return normals(x, y, z);
+            }
+            const int64_t r = (z - zb) * nRowsY + (y - yb);
+            if (!gradientValid[r]) {
+                gradientRows[r].resize(nVoxels);
+                gradientRow(volume, x0, nVoxels, y, z, flipFaces, gradientRows[r].data());
+                gradientValid[r] = 1;
+            }
+            return gradientRows[r][x - x0];
+        };
+        for (int64_t z = bricks.voxelBegin(span.z, 2); z < (int64_t)bricks.voxelEnd(span.z, 2); z++) {
+            for (int64_t y = bricks.voxelBegin(span.y, 1); y < (int64_t)bricks.voxelEnd(span.y, 1); y++) {
+                ClassifyRow(volume.row(y, z) + x0, nVoxels, isoLevel, mask.data());
+                for (int axis = 0; axis < 3; axis++) {
+                    const int64_t ox = axis == 0 ? 1 : 0;
+                    const int64_t oy = axis == 1 ? 1 : 0;
+                    const int64_t oz = axis == 2 ? 1 : 0;
+                    if (y + oy >= (int64_t)volume.size(1) || z + oz >= (int64_t)volume.size(2)) {
+                        continue;
+                    }
+
+                    int64_t nEdges = x1 - x0;
+                    if (axis == 0) {
+                        nEdges = std::min(x1, (int64_t)volume.size(0) - 1) - x0;
+                        CrossingRowEdges(mask.data(), nEdges, crossing.data());
+                    } else {
+                        std::vector<uint64_t> &other = axis == 1 ? maskY : maskZ;
+                        ClassifyRow(volume.row(y + oy, z + oz) + x0, nEdges, isoLevel, other.data());
+                        CrossingRowPairs(mask.data(), other.data(), nEdges, crossing.data());
+                    }
+
+                    for (int64_t w = 0; w < (int64_t)RowMaskWords(nEdges); w++) {
+                        uint64_t bits = crossing[w];
+                        while (bits) {
+                            const int64_t x = x0 + w * 64 + LowestBit(bits);
+                            bits &= bits - 1;
+
+                            const double v0 = Traits::normalize(volume(x, y, z));
+                            const double v1 = Traits::normalize(volume(x + ox, y + oy, z + oz));
+                            const Vec3 p0 = Vec3(x, y, z);
+                            const Vec3 p1 = Vec3(x + ox, y + oy, z + oz);
+                            const Vec3 p = VertexInterp(threshold, p0, p1, v0, v1);
+                            const Vec3 n0 = normalAt(x, y, z);
+                            const Vec3 n1 = normalAt(x + ox, y + oy, z + oz);
+                            const Vec3 n = normalize(std::abs(v1 - threshold) * n0 + std::abs(v0 - threshold) * n1);
+                            crossings.push_back({ voxelId(x, y, z) * 3 + axis, p, n });
+                        }
+                    }
                 }
             }
         }
     }
 
-    // Y axis
-    edges[1] = Array3D<std::tuple<Vec3, Vec3>>(volume.size(0), volume.size(1) - 1, volume.size(2));
-    for (int64_t z = 0; z < (int64_t)volume.size(2); z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1) - 1; y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0); x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x, y + 1, z) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    const Vec3 p0 = Vec3(x, y, z);
-                    const Vec3 p1 = Vec3(x, y + 1, z);
-                    const Vec3 p = VertexInterp(threshold, p0, p1, v0, v1);
-                    const Vec3 n0 = normals(x, y, z);
-                    const Vec3 n1 = normals(x, y + 1, z);
-                    const Vec3 n = normalize(std::abs(v1 - threshold) * n0 + std::abs(v0 - threshold) * n1);
-                    edges[1](x, y, z) = std::make_tuple(p, n);
-                }
+    std::sort(crossings.begin(), crossings.end(),
+              [](const CrossingEdge &e0, const CrossingEdge &e1) { return e0.id < e1.id; });
+    const auto findEdge = [&](uint64_t id) -> const CrossingEdge * {
+        const auto it = std::lower_bound(crossings.begin(), crossings.end(), id,
+                                         [](const CrossingEdge &e, uint64_t id) { return e.id < id; });
+        return it != crossings.end() && it->id == id ? &(*it) : nullptr;
+    };
+
+    // Define vertex positions of iso-surface. Only the cells around the crossing edges are active,
+    // and their vertices are stored in the order of cell IDs.
+    static const int offset0[4] = { 0, 1, 0, 1 };
+    static const int offset1[4] = { 0, 0, 1, 1 };
+    std::vector<uint64_t> cellIds;
+    cellIds.reserve(crossings.size() * 4);
+    for (const auto &e : crossings) {
+        const int axis = (int)(e.id % 3);
+        const int64_t x = (e.id / 3) % sizeX;
+        const int64_t y = (e.id / 3 / sizeX) % volume.size(1);
+        const int64_t z = (e.id / 3) / sizeXY;
+        for (int k = 0; k < 4; k++) {
+            const int64_t cx = x - (axis == 0 ? 0 : axis == 1 ? offset1[k] : offset0[k]);
+            const int64_t cy = y - (axis == 1 ? 0 : axis == 2 ? offset1[k] : offset0[k]);
+            const int64_t cz = z - (axis == 2 ? 0 : axis == 0 ? offset1[k] : offset0[k]);
+            if (cx >= 0 && cy >= 0 && cz >= 0 && cx < (int64_t)volume.size(0) - 1 &&
+                cy < (int64_t)volume.size(1) - 1 && cz < (int64_t)volume.size(2) - 1) {
+                cellIds.push_back(voxelId(cx, cy, cz));
             }
         }
     }
+    std::sort(cellIds.begin(), cellIds.end());
+    cellIds.erase(std::unique(cellIds.begin(), cellIds.end()), cellIds.end());
+
+    // Each cell accumulates the QEF of its crossing edges independently, so the cells are processed in parallel.
+    std::vector<ActiveCell> cells(cellIds.size());
 
-    // Z axis
-    edges[2] = Array3D<std::tuple<Vec3, Vec3>>(volume.size(0), volume.size(1), volume.size(2) - 1);
-    for (int64_t z = 0; z < (int64_t)volume.size(2) - 1; z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1); y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0); x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x, y, z + 1) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    const Vec3 p0 = Vec3(x, y, z);
-                    const Vec3 p1 = Vec3(x, y, z + 1);
-                    const Vec3 p = VertexInterp(threshold, p0, p1, v0, v1);
-                    const Vec3 n0 = normals(x, y, z);
-                    const Vec3 n1 = normals(x, y, z + 1);
-                    const Vec3 n = normalize(std::abs(v1 - threshold) * n0 + std::abs(v0 - threshold) * n1);
-                    edges[2](x, y, z) = std::make_tuple(p, n);
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1024)
+    #endif
+    for (int64_t i = 0; i < (int64_t)cellIds.size(); i++) {
+        const int64_t x = cellIds[i] % sizeX;
+        const int64_t y = (cellIds[i] / sizeX) % volume.size(1);
+        const int64_t z = cellIds[i] / sizeXY;
+        const Vec3 origin(x, y, z);
+
+        // X, Y and Z axes
+        QEF qef;
+        for (int axis = 0; axis < 3; axis++) {
+            for (int k = 0; k < 4; k++) {
+                const int64_t nx = x + (axis == 0 ? 0 : axis == 1 ? offset1[k] : offset0[k]);
+                const int64_t ny = y + (axis == 1 ? 0 : axis == 2 ? offset1[k] : offset0[k]);
+                const int64_t nz = z + (axis == 2 ? 0 : axis == 0 ? offset1[k] : offset0[k]);
+                const CrossingEdge *edge = findEdge(voxelId(nx, ny, nz) * 3 + axis);
+                if (edge != nullptr && length(edge->p - origin) != 0.0 && length(edge->n) != 0.0) {
+                    qef.add(edge->p, edge->n);
                 }
             }
         }
+
+        const Vec3 center(x + 0.5, y + 0.5, z + 0.5);
+        cells[i] = { cellIds[i], qef, qef.count != 0 ? qef.solve(0.1) : center };
     }
 
-    // Define vertex positions of iso-surface
-    using EigenMatrix3 = Eigen::Matrix<double, 3, 3>;
-    using EigenVector3 = Eigen::Matrix<double, 3, 1>;
-    static const int offset0[4] = { 0, 1, 0, 1 };
-    static const int offset1[4] = { 0, 0, 1, 1 };
-    Array3D<Vec3> cubes(volume.size(0) - 1, volume.size(1) - 1, volume.size(2) - 1);
-    for (int64_t z = 0; z < (int64_t)volume.size(2) - 1; z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1) - 1; y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0) - 1; x++) {
-                EigenMatrix3 AA;
-                AA.setZero();
-                EigenVector3 bb;
-                bb.setZero();
-                int count = 0;
-                Vec3 avg(0.0);
-
-                // X axis
-                for (int k = 0; k < 4; k++) {
-                    const int64_t nx = x;
-                    const int64_t ny = y + offset0[k];
-                    const int64_t nz = z + offset1[k];
-                    const Vec3 &p = std::get<0>(edges[0](nx, ny, nz)) - Vec3(x, y, z);
-                    const Vec3 &n = std::get<1>(edges[0](nx, ny, nz));
-                    if (length(p) != 0.0 && length(n) != 0.0) {
-                        EigenVector3 nn;
-                        nn << n.x, n.y, n.z;
-                        EigenVector3 pp;
-                        pp << p.x, p.y, p.z;
-
-                        const EigenMatrix3 M = nn * nn.transpose();
-                        AA += M;
-                        bb += M * pp;
-                        avg += p;
-                        count += 1;
-                    }
-                }
+    const auto findCell = [&](int64_t x, int64_t y, int64_t z) -> int64_t {
+        const uint64_t id = voxelId(x, y, z);
+        const auto it = std::lower_bound(cells.begin(), cells.end(), id,
+                                         [](const ActiveCell &c, uint64_t id) { return c.id < id; });
+        if (it == cells.end() || it->id != id) {
+            throw std::runtime_error("Cell around a crossing edge is not active!");
+        }
+        return it - cells.begin();
+    };
 
-                // Y axis
-                for (int k = 0; k < 4; k++) {
-                    const int64_t nx = x + offset1[k];
-                    const int64_t ny = y;
-                    const int64_t nz = z + offset0[k];
-                    const Vec3 &p = std::get<0>(edges[1](nx, ny, nz)) - Vec3(x, y, z);
-                    const Vec3 &n = std::get<1>(edges[1](nx, ny, nz));
-                    if (length(p) != 0.0 && length(n) != 0.0) {
-                        EigenVector3 nn;
-                        nn << n.x, n.y, n.z;
-                        EigenVector3 pp;
-                        pp << p.x, p.y, p.z;
-
-                        const EigenMatrix3 M = nn * nn.transpose();
-                        AA += M;
-                        bb += M * pp;
-                        avg += p;
-                        count += 1;
-                    }
-                }
+    // Cells represented by the same vertex
+    std::vector<uint32_t> groups;
+    std::vector<Vec3> positions;
+    if (tolerance >= 0.0) {
+        simplifyCells(volume, cells, tolerance, &groups, &positions);
+        printf("Simplified cells: %d -> %d\n", (int)cells.size(), (int)positions.size());
+    } else {
+        groups.resize(cells.size());
+        for (size_t i = 0; i < cells.size(); i++) {
+            groups[i] = (uint32_t)i;
+            positions.push_back(cells[i].p);
+        }
+    }
 
-                // Z axis
-                for (int k = 0; k < 4; k++) {
-                    const int64_t nx = x + offset0[k];
-                    const int64_t ny = y + offset1[k];
-                    const int64_t nz = z;
-                    const Vec3 &p = std::get<0>(edges[2](nx, ny, nz)) - Vec3(x, y, z);
-                    const Vec3 &n = std::get<1>(edges[2](nx, ny, nz));
-                    if (length(p) != 0.0 && length(n) != 0.0) {
-                        EigenVector3 nn;
-                        nn << n.x, n.y, n.z;
-                        EigenVector3 pp;
-                        pp << p.x, p.y, p.z;
-
-                        const EigenMatrix3 M = nn * nn.transpose();
-                        AA += M;
-                        bb += M * pp;
-                        avg += p;
-                        count += 1;
-                    }
-                }
+    // Groups whose QEF solutions snap to the same position share the vertex, so that the triangles between them
+    // are removed as degenerate ones instead of having no area
+    std::unordered_map<Vec3, uint32_t> uniquePositions;
+    std::vector<uint32_t> merged(positions.size());
+    for (size_t g = 0; g < positions.size(); g++) {
+        merged[g] = uniquePositions.emplace(positions[g], (uint32_t)g).first->second;
+    }
+    for (auto &g : groups) {
+        g = merged[g];
+    }
 
-                if (count != 0) {
-                    Eigen::JacobiSVD<EigenMatrix3> svd;
-                    svd.compute(AA, Eigen::ComputeFullU | Eigen::ComputeFullV);
-                    double det = 1.0;
-                    auto values = svd.singularValues();
-                    for (int dim = 0; dim < values.size(); dim++) {
-                        const double v = std::abs(values(dim)) < 0.1 ? 0.0 : values(dim);
-                        det *= v;
-                        values(dim) = v == 0.0 ? 0.0 : 1.0 / v;
-                    }
-                    const EigenMatrix3 AAinv = svd.matrixU() * values.asDiagonal() * svd.matrixV().transpose();
+    // Dual contouring. Each group of cells has one vertex, which is output when it is used first.
+    int64_t rectangle[4];
+    int triindex[2][3] = { {0, 1, 3}, {0, 3, 2} };
+    std::vector<int64_t> groupVertices(positions.size(), -1);
 
-                    EigenVector3 xx;
-                    if (det != 0.0) {
-                        xx = AAinv * bb;
-                    } else {
-                        avg = avg / count;
-                        xx << avg.x, avg.y, avg.z;
-                    }
+    for (const auto &e : crossings) {
+        const int axis = (int)(e.id % 3);
+        const int64_t x = (e.id / 3) % sizeX;
+        const int64_t y = (e.id / 3 / sizeX) % volume.size(1);
+        const int64_t z = (e.id / 3) / sizeXY;
 
-//                    EigenVector3 cc;
-//                    cc << avg.x, avg.y, avg.z;
+        // Edges on the faces of the volume lack some of the four cells around them
+        if ((axis != 0 && (x == 0 || x >= (int64_t)volume.size(0) - 1)) ||
+            (axis != 1 && (y == 0 || y >= (int64_t)volume.size(1) - 1)) ||
+            (axis != 2 && (z == 0 || z >= (int64_t)volume.size(2) - 1))) {
+            continue;
+        }
 
-//                    const double beta = 1.0e-2;
-//                    const EigenVector3 xx = (AA + beta * II).ldlt().solve(bb + beta * cc);
+        const double v0 = Traits::normalize(volume(x, y, z));
+        const double v1 = Traits::normalize(volume(x + (axis == 0), y + (axis == 1), z + (axis == 2)));
+        if (axis == 0) {
+            rectangle[0] = findCell(x, y - 1, z - 1);
+            rectangle[1] = findCell(x, y, z - 1);
+            rectangle[2] = findCell(x, y - 1, z);
+            rectangle[3] = findCell(x, y, z);
+        } else if (axis == 1) {
+            rectangle[0] = findCell(x - 1, y, z - 1);
+            rectangle[1] = findCell(x - 1, y, z);
+            rectangle[2] = findCell(x, y, z - 1);
+            rectangle[3] = findCell(x, y, z);
+        } else {
+            rectangle[0] = findCell(x - 1, y - 1, z);
+            rectangle[1] = findCell(x, y - 1, z);
+            rectangle[2] = findCell(x - 1, y, z);
+            rectangle[3] = findCell(x, y, z);
+        }
 
-                    const double cx = x + xx(0); //std::max(0.0, std::min(xx(0), 1.0));
-                    const double cy = y + xx(1); //std::max(0.0, std::min(xx(1), 1.0));
-                    const double cz = z + xx(2); //std::max(0.0, std::min(xx(2), 1.0));
-                    cubes(x, y, z) = Vec3(cx, cy, cz);
-                } else {
-                    cubes(x, y, z) =  Vec3(x + 0.5, y + 0.5, z + 0.5);
+        for (int t = 0; t < 2; t++) {
+            uint32_t tri[3];
+            for (int k = 0; k < 3; k++) {
+                const int64_t c = (v0 > v1) ? rectangle[triindex[t][k]] : rectangle[triindex[t][3 - k - 1]];
+                const uint32_t g = groups[c];
+                if (groupVertices[g] < 0) {
+                    groupVertices[g] = (int64_t)vertices->size();
+                    vertices->push_back(positions[g]);
                 }
+                tri[k] = (uint32_t)groupVertices[g];
+            }
+
+            if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
+                indices->push_back(tri[0]);
+                indices->push_back(tri[1]);
+                indices->push_back(tri[2]);
             }
         }
     }
 
-    // Dual contouring
-    Vec3 rectangle[4];
-    int triindex[2][3] = { {0, 1, 3}, {0, 3, 2} };
-    std::unordered_map<Vec3, uint32_t> uniqueVertices;
-
-    const int64_t totalSteps = 3 * (volume.size(1) - 1) * (volume.size(2) - 1);
-    ProgressBar pbar(totalSteps);
-
-    // X axis
-    for (int64_t z = 1; z < (int64_t)volume.size(2); z++) {
-        for (int64_t y = 1; y < (int64_t)volume.size(1); y++) {
-            for (int64_t x = 0; x < (int64_t)volume.size(0) - 1; x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x + 1, y, z) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    rectangle[0] = cubes(x, y - 1, z - 1);
-                    rectangle[1] = cubes(x, y, z - 1);
-                    rectangle[2] = cubes(x, y - 1, z);
-                    rectangle[3] = cubes(x, y, z);
-
-                    for (int t = 0; t < 2; t++) {
-                        uint32_t tri[3];
-                        for (int k = 0; k < 3; k++) {
-                            const Vec3 &v = (v0 > v1) ? rectangle[triindex[t][k]] : rectangle[triindex[t][3 - k - 1]];
-                            if (uniqueVertices.count(v) == 0) {
-                                uniqueVertices[v] = static_cast<uint32_t>(vertices->size());
-                                vertices->push_back(v);
-                            }
-                            tri[k] = uniqueVertices[v];
-                        }
+    // Fine edges along the boundary of a collapsed cell may yield the same triangle many times. Triangles with
+    // the same orientation are merged into one, and pairs of triangles with opposite orientations cancel out.
+    if (tolerance >= 0.0) {
+        const size_t nFaces = indices->size() / 3;
+        std::vector<std::array<uint32_t, 5>> faces(nFaces);  // sorted vertices, parity, index
+        for (size_t i = 0; i < nFaces; i++) {
+            uint32_t a = (*indices)[i * 3 + 0], b = (*indices)[i * 3 + 1], c = (*indices)[i * 3 + 2];
+            uint32_t parity = 0;
+            if (a > b) std::swap(a, b), parity ^= 1;
+            if (b > c) std::swap(b, c), parity ^= 1;
+            if (a > b) std::swap(a, b), parity ^= 1;
+            faces[i] = { a, b, c, parity, (uint32_t)i };
+        }
+        std::sort(faces.begin(), faces.end());
 
-                        if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
-                            indices->push_back(tri[0]);
-                            indices->push_back(tri[1]);
-                            indices->push_back(tri[2]);
-                        }
-                    }
+        std::vector<char> keep(nFaces, 0);
+        for (size_t i = 0; i < nFaces;) {
+            size_t j = i;
+            int count[2] = { 0, 0 };
+            for (; j < nFaces && std::equal(faces[j].begin(), faces[j].begin() + 3, faces[i].begin()); j++) {
+                count[faces[j][3]] += 1;
+            }
+            for (size_t k = i; k < j; k++) {
+                const uint32_t parity = faces[k][3];
+                if (count[parity] > count[1 - parity] && (k == i || faces[k - 1][3] != parity)) {
+                    keep[faces[k][4]] = 1;
                 }
             }
-            pbar.step();
+            i = j;
         }
-    }
 
-    // Y axis
-    for (int64_t z = 1; z < (int64_t)volume.size(2); z++) {
-        for (int64_t y = 0; y < (int64_t)volume.size(1) - 1; y++) {
-            for (int64_t x = 1; x < (int64_t)volume.size(0); x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x, y + 1, z) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    rectangle[0] = cubes(x - 1, y, z - 1);
-                    rectangle[1] = cubes(x - 1, y, z);
-                    rectangle[2] = cubes(x, y,  z - 1);
-                    rectangle[3] = cubes(x, y, z);
-
-                    for (int t = 0; t < 2; t++) {
-                        uint32_t tri[3];
-                        for (int k = 0; k < 3; k++) {
-                            const Vec3 &v = (v0 > v1) ? rectangle[triindex[t][k]] : rectangle[triindex[t][3 - k - 1]];
-                            if (uniqueVertices.count(v) == 0) {
-                                uniqueVertices[v] = static_cast<uint32_t>(vertices->size());
-                                vertices->push_back(v);
-                            }
-                            tri[k] = uniqueVertices[v];
-                        }
-
-                        if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
-                            indices->push_back(tri[0]);
-                            indices->push_back(tri[1]);
-                            indices->push_back(tri[2]);
-                        }
-                    }
+        size_t n = 0;
+        for (size_t i = 0; i < nFaces; i++) {
+            if (keep[i]) {
+                for (int k = 0; k < 3; k++) {
+                    (*indices)[n * 3 + k] = (*indices)[i * 3 + k];
                 }
+                n++;
             }
-            pbar.step();
         }
+        indices->resize(n * 3);
+
+        // Vertices whose triangles have all cancelled out are removed, keeping the order of the others
+        std::vector<int64_t> remap(vertices->size(), -1);
+        for (uint32_t v : *indices) {
+            remap[v] = 0;
+        }
+        size_t nVerts = 0;
+        for (size_t i = 0; i < vertices->size(); i++) {
+            if (remap[i] >= 0) {
+                remap[i] = (int64_t)nVerts;
+                (*vertices)[nVerts++] = (*vertices)[i];
+            }
+        }
+        vertices->resize(nVerts);
+        for (auto &v : *indices) {
+            v = (uint32_t)remap[v];
+        }
+    }
+
+    printf("#vert: %d\n", (int)vertices->size());
+    printf("#face: %d\n", (int)indices->size() / 3);
+}
+
+void dualContour(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold, bool flipFaces,
+                 bool lazyGradients) {
+    const BrickTree bricks(volume);
+    dualContour(volume, bricks, vertices, indices, threshold, flipFaces, lazyGradients);
+}
+
+void dualContour(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold, bool flipFaces, bool lazyGradients) {
+    dualContourImpl(volume, bricks, vertices, indices, threshold, flipFaces, lazyGradients, -1.0);
+}
+
+void dualContourAdaptive(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                         double threshold, bool flipFaces, double tolerance) {
+    const BrickTree bricks(volume);
+    dualContourAdaptive(volume, bricks, vertices, indices, threshold, flipFaces, tolerance);
+}
+
+void dualContourAdaptive(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                         std::vector<uint32_t> *indices, double threshold, bool flipFaces, double tolerance) {
+    dualContourImpl(volume, bricks, vertices, indices, threshold, flipFaces, true, std::max(0.0, tolerance));
+}
+
+void dualContour(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                 double threshold, bool flipFaces, bool lazyGradients) {
+    const FloatBrickTree bricks(volume);
+    dualContour(volume, bricks, vertices, indices, threshold, flipFaces, lazyGradients);
+}
+
+void dualContour(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold, bool flipFaces, bool lazyGradients) {
+    dualContourImpl(volume, bricks, vertices, indices, threshold, flipFaces, lazyGradients, -1.0);
+}
+
+void dualContourAdaptive(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                         double threshold, bool flipFaces, double tolerance) {
+    const FloatBrickTree bricks(volume);
+    dualContourAdaptive(volume, bricks, vertices, indices, threshold, flipFaces, tolerance);
+}
+
+void dualContourAdaptive(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                         std::vector<uint32_t> *indices, double threshold, bool flipFaces, double tolerance) {
+    dualContourImpl(volume, bricks, vertices, indices, threshold, flipFaces, true, std::max(0.0, tolerance));
+}
+
+// }}
+
+
+void surfaceNets(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold,
+                 bool flipFaces) {
+    const BrickTree bricks(volume);
+    surfaceNets(volume, bricks, vertices, indices, threshold, flipFaces);
+}
+
+void surfaceNets(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold, bool flipFaces) {
+    ArrayMeshSink sink(vertices, indices);
+    surfaceNets(volume, bricks, &sink, threshold, flipFaces);
+}
+
+void surfaceNets(const Volume &volume, MeshSink *sink, double threshold, bool flipFaces) {
+    const BrickTree bricks(volume);
+    surfaceNets(volume, bricks, sink, threshold, flipFaces);
+}
+
+void surfaceNets(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                 double threshold, bool flipFaces) {
+    const FloatBrickTree bricks(volume);
+    ArrayMeshSink sink(vertices, indices);
+    surfaceNets(volume, bricks, &sink, threshold, flipFaces);
+}
+
+// The slabs of active bricks are processed in parallel slice by slice. Each thread keeps the vertex indices of
+// the cells in the current and previous slices, and the quads of the edges at the lower corner of each active
+// cell only refer to them. A slab also computes the vertices of the last slice of the previous slab, so that they
+// can be mapped to the ones of the previous slab when the slabs are merged in order.
+template <typename T>
+static void surfaceNetsImpl(const BasicVolume<T> &volume, const BasicBrickTree<T> &bricks, MeshSink *sink,
+                            double threshold, bool flipFaces) {
+    using Traits = VoxelTraits<T>;
+
+    // Compute threshold with Otsu's method, if threshold is not specified.
+    threshold = resolveThreshold(volume, threshold);
+    printf("Threshold: %.5f\n", threshold);
+
+    const typename Traits::IsoLevel isoLevel = Traits::isoLevel(threshold);
+    std::vector<BrickSpan> spans;
+    findActiveSpans(bricks, isoLevel, &spans);
+
+    // Slabs of the spans, which are sorted by their brick rows
+    struct Slab {
+        uint64_t bz;
+        size_t first, last;
+        std::vector<Vec3> vertices;
+        std::vector<uint32_t> indices;
+        uint32_t nSeam;       // number of vertices in the last slice of the previous slab
+        uint32_t nLastSlice;  // number of vertices in the last slice of this slab
+    };
+
+    std::vector<Slab> slabs;
+    for (size_t s = 0; s < spans.size(); s++) {
+        if (slabs.empty() || slabs.back().bz != spans[s].z) {
+            slabs.push_back({ spans[s].z, s, s, {}, {}, 0, 0 });
+        }
+        slabs.back().last = s + 1;
     }
 
-    // Z axis
-    for (int64_t z = 0; z < (int64_t)volume.size(2) - 1; z++) {
-        for (int64_t y = 1; y < (int64_t)volume.size(1); y++) {
-            for (int64_t x = 1; x < (int64_t)volume.size(0); x++) {
-                const double v0 = volume(x, y, z) / (double)USHRT_MAX;
-                const double v1 = volume(x, y, z + 1) / (double)USHRT_MAX;
-                if ((v0 < threshold) != (v1 < threshold)) {
-                    rectangle[0] = cubes(x - 1, y - 1, z);
-                    rectangle[1] = cubes(x, y - 1, z);
-                    rectangle[2] = cubes(x - 1, y, z);
-                    rectangle[3] = cubes(x, y, z);
-
-                    for (int t = 0; t < 2; t++) {
-                        uint32_t tri[3];
-                        for (int k = 0; k < 3; k++) {
-                            const Vec3 &v = (v0 > v1) ? rectangle[triindex[t][k]] : rectangle[triindex[t][3 - k - 1]];
-                            if (uniqueVertices.count(v) == 0) {
-                                uniqueVertices[v] = static_cast<uint32_t>(vertices->size());
-                                vertices->push_back(v);
+    const uint64_t nCellsX = volume.size(0) - 1;
+    const uint64_t nCellsY = volume.size(1) - 1;
+    const uint32_t noVertex = UINT32_MAX;
+    static const int triindex[2][3] = { { 0, 1, 3 }, { 0, 3, 2 } };
+
+    // Merge the slabs in order. The vertices of the seam slice are replaced with the last ones of the previous slab.
+    uint64_t nVerts = 0;
+    size_t nFaces = 0;
+    const auto emitSlab = [&](size_t s) {
+        Slab &slab = slabs[s];
+        if (slab.nSeam != (s > 0 && slabs[s - 1].bz + 1 == slab.bz ? slabs[s - 1].nLastSlice : 0)) {
+            throw std::runtime_error("Vertices on the boundary of slabs do not match!");
+        }
+
+        const uint64_t seamBegin = nVerts - slab.nSeam;
+        for (uint32_t &v : slab.indices) {
+            v = (uint32_t)(v < slab.nSeam ? seamBegin + v : nVerts + v - slab.nSeam);
+        }
+        sink->addVertices(slab.vertices.data() + slab.nSeam, slab.vertices.size() - slab.nSeam);
+        sink->addFaces(slab.indices.data(), slab.indices.size());
+        nVerts += slab.vertices.size() - slab.nSeam;
+        nFaces += slab.indices.size() / 3;
+        slab.vertices = std::vector<Vec3>();
+        slab.indices = std::vector<uint32_t>();
+    };
+
+    // Slabs are emitted as soon as they and all the slabs before them are finished
+    SlabHandoff handoff(slabs.size());
+    ProgressBar pbar((int)slabs.size());
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        // Vertex indices of the cells in the previous and current slices
+        std::vector<uint32_t> prevSlice(nCellsX * nCellsY, noVertex), currSlice(nCellsX * nCellsY, noVertex);
+        std::vector<uint64_t> prevTouched, currTouched;
+
+        const uint64_t nWords = RowMaskWords(volume.size(0));
+        std::vector<uint64_t> m00(nWords), m10(nWords), m01(nWords), m11(nWords), active(nWords);
+        std::vector<uint8_t> cases(volume.size(0));
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int64_t s = 0; s < (int64_t)slabs.size(); s++) {
+            Slab &slab = slabs[s];
+            const bool seam = s > 0 && slabs[s - 1].bz + 1 == slab.bz;
+            const uint64_t z0 = bricks.cellBegin(slab.bz, 2);
+            const uint64_t z1 = bricks.cellEnd(slab.bz, 2);
+
+            for (uint64_t i : prevTouched) prevSlice[i] = noVertex;
+            for (uint64_t i : currTouched) currSlice[i] = noVertex;
+            prevTouched.clear();
+            currTouched.clear();
+
+            for (uint64_t z = seam ? z0 - 1 : z0; z < z1; z++) {
+                std::swap(prevSlice, currSlice);
+                std::swap(prevTouched, currTouched);
+                for (uint64_t i : currTouched) currSlice[i] = noVertex;
+                currTouched.clear();
+
+                // The slice before the slab is only used for the vertices shared with the previous slab
+                const bool inSlab = z >= z0;
+                const size_t first = inSlab ? slab.first : slabs[s - 1].first;
+                const size_t last = inSlab ? slab.last : slabs[s - 1].last;
+                const uint32_t sliceBegin = (uint32_t)slab.vertices.size();
+
+                for (size_t k = first; k < last; k++) {
+                    const BrickSpan &span = spans[k];
+                    const uint64_t x0 = bricks.cellBegin(span.begin, 0);
+                    const uint64_t nCells = bricks.cellEnd(span.end - 1, 0) - x0;
+                    const uint64_t y0 = bricks.cellBegin(span.y, 1);
+                    ClassifyRow(volume.row(y0, z) + x0, nCells + 1, isoLevel, m00.data());
+                    ClassifyRow(volume.row(y0, z + 1) + x0, nCells + 1, isoLevel, m01.data());
+                    for (uint64_t y = y0; y < bricks.cellEnd(span.y, 1); y++) {
+                        ClassifyRow(volume.row(y + 1, z) + x0, nCells + 1, isoLevel, m10.data());
+                        ClassifyRow(volume.row(y + 1, z + 1) + x0, nCells + 1, isoLevel, m11.data());
+                        ClassifyCells(m00.data(), m10.data(), m01.data(), m11.data(), nCells, active.data(),
+                                      cases.data());
+
+                        for (uint64_t w = 0; w < RowMaskWords(nCells); w++) {
+                            uint64_t bits = active[w];
+                            while (bits) {
+                                const int i = LowestBit(bits);
+                                bits &= bits - 1;
+                                const uint64_t x = x0 + w * 64 + i;
+                                const int cubeindex = cases[w * 64 + i];
+
+                                // Average of the crossing points on the cell edges
+                                double val[8];
+                                for (int v = 0; v < 8; v++) {
+                                    const int *d = cubeVertexOffsets[v];
+                                    val[v] = Traits::normalize(volume(x + d[0], y + d[1], z + d[2]));
+                                }
+                                Vec3 p(0.0, 0.0, 0.0);
+                                int count = 0;
+                                for (int e = 0; e < 12; e++) {
+                                    const int a = cubeEdgeVertices[e][0];
+                                    const int b = cubeEdgeVertices[e][1];
+                                    if (((cubeindex >> a) & 1) != ((cubeindex >> b) & 1)) {
+                                        const int *da = cubeVertexOffsets[a];
+                                        const int *db = cubeVertexOffsets[b];
+                                        const Vec3 pa(x + da[0], y + da[1], z + da[2]);
+                                        const Vec3 pb(x + db[0], y + db[1], z + db[2]);
+                                        p += VertexInterp(threshold, pa, pb, val[a], val[b]);
+                                        count++;
+                                    }
+                                }
+
+                                const uint64_t c = y * nCellsX + x;
+                                currSlice[c] = (uint32_t)slab.vertices.size();
+                                currTouched.push_back(c);
+                                slab.vertices.push_back(p / count);
+                                if (!inSlab) {
+                                    continue;
+                                }
+
+                                // Quads of the edges along the X, Y and Z axes from the lower corner, which
+                                // are shared with the cells at the lower side (i.e., visited before this cell).
+                                static const int corners[3] = { 1, 4, 3 };  // upper end points in "cubeVertexOffsets"
+                                for (int axis = 0; axis < 3; axis++) {
+                                    const bool inside0 = (cubeindex & 1) != 0;
+                                    const bool inside1 = ((cubeindex >> corners[axis]) & 1) != 0;
+                                    if (inside0 == inside1 || (axis != 0 && x == 0) || (axis != 1 && y == 0) ||
+                                        (axis != 2 && z == 0)) {
+                                        continue;
+                                    }
+
+                                    uint32_t rectangle[4];
+                                    if (axis == 0) {
+                                        rectangle[0] = prevSlice[c - nCellsX];
+                                        rectangle[1] = prevSlice[c];
+                                        rectangle[2] = currSlice[c - nCellsX];
+                                        rectangle[3] = currSlice[c];
+                                    } else if (axis == 1) {
+                                        rectangle[0] = prevSlice[c - 1];
+                                        rectangle[1] = currSlice[c - 1];
+                                        rectangle[2] = prevSlice[c];
+                                        rectangle[3] = currSlice[c];
+                                    } else {
+                                        rectangle[0] = currSlice[c - nCellsX - 1];
+                                        rectangle[1] = currSlice[c - nCellsX];
+                                        rectangle[2] = currSlice[c - 1];
+                                        rectangle[3] = currSlice[c];
+                                    }
+                                    if (std::find(rectangle, rectangle + 4, noVertex) != rectangle + 4) {
+                                        continue;
+                                    }
+
+                                    // Orient the quads in the same way as the triangles of "marchCubes"
+                                    const bool reverse = inside0 == flipFaces;
+                                    for (int t = 0; t < 2; t++) {
+                                        for (int k = 0; k < 3; k++) {
+                                            const int j = reverse ? triindex[t][2 - k] : triindex[t][k];
+                                            slab.indices.push_back(rectangle[j]);
+                                        }
+                                    }
+                                }
                             }
-                            tri[k] = uniqueVertices[v];
                         }
 
-                        if (tri[0] != tri[1] && tri[0] != tri[2] && tri[1] != tri[2]) {
-                            indices->push_back(tri[0]);
-                            indices->push_back(tri[1]);
-                            indices->push_back(tri[2]);
-                        }
+                        std::swap(m00, m10);
+                        std::swap(m01, m11);
                     }
                 }
+
+                if (!inSlab) {
+                    slab.nSeam = (uint32_t)slab.vertices.size();
+                }
+                slab.nLastSlice = (uint32_t)slab.vertices.size() - sliceBegin;
             }
+
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
             pbar.step();
+
+            handoff.finish(s, emitSlab);
         }
     }
+    handoff.rethrow();
 
-    printf("#vert: %d\n", (int)vertices->size());
-    printf("#face: %d\n", (int)indices->size() / 3);
+    printf("#vert: %d\n", (int)nVerts);
+    printf("#face: %d\n", (int)nFaces);
 }
 
-// }}
+void surfaceNets(const Volume &volume, const BrickTree &bricks, MeshSink *sink, double threshold, bool flipFaces) {
+    surfaceNetsImpl(volume, bricks, sink, threshold, flipFaces);
+}
+
+void surfaceNets(const FloatVolume &volume, const FloatBrickTree &bricks, MeshSink *sink, double threshold,
+                 bool flipFaces) {
+    surfaceNetsImpl(volume, bricks, sink, threshold, flipFaces);
+}
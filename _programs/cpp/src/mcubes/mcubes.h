@@ -1,9 +1,14 @@
 #pragma once
 
+#include <array>
+#include <functional>
 #include <vector>
 
 #include "common/vec3.h"
 #include "common/volume.h"
+#include "brick_tree.h"
+
+class MeshSink;
 
 void marchCubes(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
                 double threshold = -1.0, bool flipFaces = false);
@@ -11,5 +16,125 @@ void marchCubes(const Volume &volume, std::vector<Vec3> *vertices, std::vector<u
 void marchTets(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
                double threshold = -1.0, bool flipFaces = false);
 
+// Normals at the end points of the edges crossing the iso-surface are evaluated lazily by default.
+// With "lazyGradients = false", they are computed in advance for all the voxels in the active bricks.
 void dualContour(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                 double threshold = -1.0, bool flipFaces = false, bool lazyGradients = true);
+
+// Adaptive dual contouring, where the active cells are merged in an octree while the residual of
+// their merged QEF is at most "tolerance" (i.e., the sum of squared distances to the tangent planes
+// of the crossing edges in voxel units). Flat regions are then covered by a few large cells, so that
+// the mesh size scales with the complexity of the surface rather than the resolution of the volume.
+// The octree is built from the crossing edges and active cells at the full resolution, however, so the peak
+// memory during the extraction still scales with the number of active cells, as in "dualContour".
+void dualContourAdaptive(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                         double threshold = -1.0, bool flipFaces = false, double tolerance = 0.1);
+
+// Surface nets, which places one vertex per active cell at the average of the crossing points of its edges,
+// and connects the vertices of the four cells around each crossing edge with a quad. No QEF is solved and
+// no vertex is hashed, so it is the fastest extractor, and is suited for previews and collision meshes.
+void surfaceNets(const Volume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
                  double threshold = -1.0, bool flipFaces = false);
+
+// The following versions take a pre-built brick hierarchy of the volume, which
+// can be shared among the calls with different thresholds.
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                std::vector<uint32_t> *indices, double threshold = -1.0, bool flipFaces = false);
+
+void marchTets(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+               std::vector<uint32_t> *indices, double threshold = -1.0, bool flipFaces = false);
+
+void dualContour(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold = -1.0, bool flipFaces = false,
+                 bool lazyGradients = true);
+
+void dualContourAdaptive(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                         std::vector<uint32_t> *indices, double threshold = -1.0, bool flipFaces = false,
+                         double tolerance = 0.1);
+
+void surfaceNets(const Volume &volume, const BrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold = -1.0, bool flipFaces = false);
+
+// Multi-isovalue version of "marchCubes", which extracts one mesh per threshold with a single
+// traversal of the volume. Negative thresholds are replaced with the one by Otsu's method.
+
+void marchCubes(const Volume &volume, const std::vector<double> &thresholds, std::vector<std::vector<Vec3>> *vertices,
+                std::vector<std::vector<uint32_t>> *indices, bool flipFaces = false);
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, const std::vector<double> &thresholds,
+                std::vector<std::vector<Vec3>> *vertices, std::vector<std::vector<uint32_t>> *indices,
+                bool flipFaces = false);
+
+// Streaming versions, which pass the vertices and faces to the sinks (see "common/io.h") slab by slab. Each slab
+// is passed and released as soon as it and all the slabs before it are extracted, while the later slabs are still
+// being extracted, so that only the slabs finished ahead of the oldest unfinished one are held in memory (plus
+// their vertex keys for "marchCubes" and "marchTets"). With "PlyStreamWriter", the meshes go to PLY files.
+
+void marchCubes(const Volume &volume, const std::vector<double> &thresholds, const std::vector<MeshSink *> &sinks,
+                bool flipFaces = false);
+
+void marchCubes(const Volume &volume, const BrickTree &bricks, const std::vector<double> &thresholds,
+                const std::vector<MeshSink *> &sinks, bool flipFaces = false);
+
+void marchTets(const Volume &volume, MeshSink *sink, double threshold = -1.0, bool flipFaces = false);
+
+void marchTets(const Volume &volume, const BrickTree &bricks, MeshSink *sink, double threshold = -1.0,
+               bool flipFaces = false);
+
+void surfaceNets(const Volume &volume, MeshSink *sink, double threshold = -1.0, bool flipFaces = false);
+
+void surfaceNets(const Volume &volume, const BrickTree &bricks, MeshSink *sink, double threshold = -1.0,
+                 bool flipFaces = false);
+
+// Versions for the volumes of floating-point values (e.g., signed distance fields), which are extracted
+// without quantization. The thresholds are in the domain of the values, and are used as they are even if
+// negative (i.e., Otsu's method is not applied), so that the default threshold is zero.
+
+void marchCubes(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                double threshold = 0.0, bool flipFaces = false);
+
+void marchCubes(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                std::vector<uint32_t> *indices, double threshold = 0.0, bool flipFaces = false);
+
+void marchCubes(const FloatVolume &volume, const FloatBrickTree &bricks, const std::vector<double> &thresholds,
+                const std::vector<MeshSink *> &sinks, bool flipFaces = false);
+
+void marchTets(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+               double threshold = 0.0, bool flipFaces = false);
+
+void marchTets(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+               std::vector<uint32_t> *indices, double threshold = 0.0, bool flipFaces = false);
+
+void dualContour(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                 double threshold = 0.0, bool flipFaces = false, bool lazyGradients = true);
+
+void dualContour(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                 std::vector<uint32_t> *indices, double threshold = 0.0, bool flipFaces = false,
+                 bool lazyGradients = true);
+
+void dualContourAdaptive(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                         double threshold = 0.0, bool flipFaces = false, double tolerance = 0.1);
+
+void dualContourAdaptive(const FloatVolume &volume, const FloatBrickTree &bricks, std::vector<Vec3> *vertices,
+                         std::vector<uint32_t> *indices, double threshold = 0.0, bool flipFaces = false,
+                         double tolerance = 0.1);
+
+void surfaceNets(const FloatVolume &volume, std::vector<Vec3> *vertices, std::vector<uint32_t> *indices,
+                 double threshold = 0.0, bool flipFaces = false);
+
+void surfaceNets(const FloatVolume &volume, const FloatBrickTree &bricks, MeshSink *sink, double threshold = 0.0,
+                 bool flipFaces = false);
+
+// Implicit function evaluated at "count" lattice points given in the voxel coordinates, which writes the values
+// to "values". It is called for the lattice points of a brick at once, from multiple threads in parallel.
+using ImplicitFunction = std::function<void(const Vec3 *points, size_t count, float *values)>;
+
+// Marching cubes of an implicit function sampled on the lattice of "sizes" points without storing the volume.
+// The bricks of the lattice are visited from the ones around "seeds" (in the voxel coordinates), and continued
+// to the neighboring bricks which the surface passes into. Hence, the function is evaluated only around the
+// surface, but the components of the surface not reachable from the seeds are missed. As for "FloatVolume",
+// the threshold is in the domain of the values, and the mesh is the same as the one from the volume.
+void marchCubes(const ImplicitFunction &func, const std::array<uint64_t, 3> &sizes, const std::vector<Vec3> &seeds,
+                std::vector<Vec3> *vertices, std::vector<uint32_t> *indices, double threshold = 0.0,
+                bool flipFaces = false);
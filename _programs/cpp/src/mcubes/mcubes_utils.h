@@ -1,6 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <climits>
+
 #include "common/vec3.h"
+#include "mcubes_tables.h"
 
 typedef Vec3 XYZ;
 
@@ -24,6 +28,48 @@ struct TETRAHEDRON {
  */
 XYZ VertexInterp(double isolevel, XYZ p1, XYZ p2, double valp1, double valp2);
 
+/*
+ * Convert a threshold for normalized values (i.e., voxel / USHRT_MAX)
+ * to the smallest voxel value which is NOT less than the threshold.
+ * A voxel is inside of the surface if and only if its value is less
+ * than the returned iso-level.
+ */
+uint32_t IsoLevelFromThreshold(double threshold);
+
+/*
+ * Voxel types of the volumes. A voxel is inside of the surface if and
+ * only if it is less than the iso-level of type "IsoLevel", and
+ * "normalize" gives its value in the domain of the thresholds.
+ */
+template <typename T>
+struct VoxelTraits;
+
+template <>
+struct VoxelTraits<uint16_t> {
+    using IsoLevel = uint32_t;
+
+    static double normalize(uint16_t v) {
+        return v / (double)USHRT_MAX;
+    }
+
+    static IsoLevel isoLevel(double threshold) {
+        return IsoLevelFromThreshold(threshold);
+    }
+};
+
+template <>
+struct VoxelTraits<float> {
+    using IsoLevel = float;
+
+    static double normalize(float v) {
+        return v;
+    }
+
+    static IsoLevel isoLevel(double threshold) {
+        return (float)threshold;
+    }
+};
+
 /*
  * Given a grid cell and an isolevel, calculate the triangular
  * facets required to represent the isosurface through the cell.
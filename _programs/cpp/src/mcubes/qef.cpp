@@ -0,0 +1,98 @@
+#include "qef.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include <Eigen/Dense>
+
+void QEF::add(const Vec3 &p, const Vec3 &n) {
+    const double d = dot(n, p);
+    ata[0] += n.x * n.x;
+    ata[1] += n.x * n.y;
+    ata[2] += n.x * n.z;
+    ata[3] += n.y * n.y;
+    ata[4] += n.y * n.z;
+    ata[5] += n.z * n.z;
+    atb[0] += n.x * d;
+    atb[1] += n.y * d;
+    atb[2] += n.z * d;
+    btb += d * d;
+    pointSum[0] += p.x;
+    pointSum[1] += p.y;
+    pointSum[2] += p.z;
+    count += 1;
+}
+
+QEF &QEF::operator+=(const QEF &other) {
+    for (int i = 0; i < 6; i++) {
+        ata[i] += other.ata[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        atb[i] += other.atb[i];
+        pointSum[i] += other.pointSum[i];
+    }
+    btb += other.btb;
+    count += other.count;
+    return *this;
+}
+
+Vec3 QEF::massPoint() const {
+    if (count == 0) {
+        return Vec3(0.0, 0.0, 0.0);
+    }
+    return Vec3(pointSum[0] / count, pointSum[1] / count, pointSum[2] / count);
+}
+
+double QEF::error(const Vec3 &x) const {
+    // x^T A^T A x - 2 x^T A^T b + b^T b
+    const double ax = ata[0] * x.x + ata[1] * x.y + ata[2] * x.z;
+    const double ay = ata[1] * x.x + ata[3] * x.y + ata[4] * x.z;
+    const double az = ata[2] * x.x + ata[4] * x.y + ata[5] * x.z;
+    const double xAx = x.x * ax + x.y * ay + x.z * az;
+    const double xAb = x.x * atb[0] + x.y * atb[1] + x.z * atb[2];
+    return std::max(0.0, xAx - 2.0 * xAb + btb);
+}
+
+Vec3 QEF::solve(double minEigenValue) const {
+    Eigen::Matrix3d A;
+    A << ata[0], ata[1], ata[2],
+         ata[1], ata[3], ata[4],
+         ata[2], ata[4], ata[5];
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+    solver.computeDirect(A);
+    const Eigen::Vector3d &values = solver.eigenvalues();
+    for (int i = 0; i < 3; i++) {
+        if (std::abs(values(i)) < minEigenValue) {
+            return massPoint();
+        }
+    }
+
+    const Eigen::Matrix3d &V = solver.eigenvectors();
+    const Eigen::Vector3d b(atb[0], atb[1], atb[2]);
+    const Eigen::Vector3d x = V * (V.transpose() * b).cwiseQuotient(values);
+    return Vec3(x(0), x(1), x(2));
+}
+
+Vec3 QEF::solveAroundMassPoint(double relativeEigenValue) const {
+    Eigen::Matrix3d A;
+    A << ata[0], ata[1], ata[2],
+         ata[1], ata[3], ata[4],
+         ata[2], ata[4], ata[5];
+
+    const Vec3 m = massPoint();
+    const Eigen::Vector3d mm(m.x, m.y, m.z);
+    const Eigen::Vector3d r = Eigen::Vector3d(atb[0], atb[1], atb[2]) - A * mm;
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+    solver.computeDirect(A);
+    Eigen::Vector3d values = solver.eigenvalues();
+    const double maxValue = values.cwiseAbs().maxCoeff();
+    for (int i = 0; i < 3; i++) {
+        values(i) = std::abs(values(i)) <= relativeEigenValue * maxValue ? 0.0 : 1.0 / values(i);
+    }
+
+    const Eigen::Matrix3d &V = solver.eigenvectors();
+    const Eigen::Vector3d x = mm + V * values.asDiagonal() * V.transpose() * r;
+    return Vec3(x(0), x(1), x(2));
+}
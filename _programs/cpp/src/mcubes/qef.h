@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common/vec3.h"
+
+//! Quadratic error function "E(x) = sum_i (n_i . (x - p_i))^2" of the Hermite data (p_i, n_i),
+//! i.e., the intersection points and normals on the edges crossing the iso-surface.
+//! Only the upper triangle of "A^T A", "A^T b", "b^T b" and the sum of points are kept,
+//! so that the QEFs of cells can be accumulated and merged by addition.
+struct QEF {
+    double ata[6] = { 0.0 };  // xx, xy, xz, yy, yz, zz
+    double atb[3] = { 0.0 };
+    double btb = 0.0;
+    double pointSum[3] = { 0.0 };
+    int count = 0;
+
+    //! Add a plane through "p" with the normal "n"
+    void add(const Vec3 &p, const Vec3 &n);
+
+    //! Merge the planes of another QEF
+    QEF &operator+=(const QEF &other);
+
+    //! Average of the points
+    Vec3 massPoint() const;
+
+    //! Value of the QEF at "x"
+    double error(const Vec3 &x) const;
+
+    //! Minimizer of the QEF. "A^T A" is decomposed with a closed-form eigen-solver for symmetric 3x3
+    //! matrices, and if any of its eigenvalues is less than "minEigenValue", the system is regarded
+    //! as degenerate and the mass point is returned instead.
+    Vec3 solve(double minEigenValue = 0.1) const;
+
+    //! Minimizer of the QEF around the mass point with the pseudo-inverse of "A^T A", where the eigenvalues
+    //! less than "relativeEigenValue" times the largest one are truncated. Unlike "solve", the solution
+    //! slides along the degenerate directions from the mass point, and is stable for nearly flat patches.
+    Vec3 solveAroundMassPoint(double relativeEigenValue = 0.1) const;
+};
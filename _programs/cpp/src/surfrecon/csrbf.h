@@ -0,0 +1,23 @@
+#pragma once
+
+#include <algorithm>
+
+#include "common/vec3.h"
+
+// Wendland's RBF
+// Morse et al. 2001,
+// "Interpolating Implicit Surfaces From Scattered Surface Data
+//  Using Compactly Supported Radial Basis Functions"
+inline double csrbf(const Vec3 &x, const Vec3 &y, double s = 0.1) {
+    const double r = length(x - y) / s;
+    const double a = std::max(0.0, 1.0 - r);
+    const double b = 4.0 * r + 1.0;
+    return (a * a * a * a) * b;
+}
+
+// Custom struct for KD tree
+struct Point : public Vec3 {
+    Point() {}
+    Point(const Vec3 &v, int index = -1) : Vec3(v), i(index) {}
+    int i;
+};
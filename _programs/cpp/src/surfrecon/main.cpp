@@ -3,6 +3,7 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <memory>
 #include <string>
 
 #include "common/path.h"
@@ -11,20 +12,104 @@
 #include "common/io.h"
 
 #include "surface_recon.h"
+#include "rbf_solver.h"
 
 int main(int argc, char **argv) {
-    if (argc <= 1) {
-        fprintf(stderr, "[ USAGE ] surfrecon [ *.off file ] [ support radius ] [ #mcube divs ] \n");
+    // "--save <file>" may be given anywhere, and the others are positional
+    std::vector<char *> args;
+    std::string saveFile;
+    for (int i = 0; i < argc; i++) {
+        if (std::string(argv[i]) == "--save" && i + 1 < argc) {
+            saveFile = argv[++i];
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    const int nArgs = (int)args.size();
+
+    if (nArgs <= 1) {
+        fprintf(stderr, "[ USAGE ] surfrecon [ *.off|*.ply|*.rbf file ] [ support radius ] [ #mcube divs ] "
+                        "[ bicgstab|ilut|gmres|lu|ldlt[+warm] ] [ matrix|neighbors|onthefly|pu ] "
+                        "[ gather|splat|band|lazy ] [ voxel size ] [ region: xmin ymin zmin xmax ymax zmax ] "
+                        "[ --save *.rbf ] \n");
+        fprintf(stderr, "  With --save, the CS-RBF function solved for a point cloud is saved (except for pu), \n"
+                        "  which is re-meshed without solving when given as the input file. \n"
+                        "  With +warm, the solver starts from the weights of the saved *.rbf if it exists. \n"
+                        "  The solver and the system are not used for the *.rbf input. \n");
+        std::exit(1);
+    }
+
+    filepath path(args[1]);
+    const filepath dirname = path.dirname();
+    const filepath basename = path.stem();
+    const bool fromModel = path.suffix().string() == "rbf";
+
+    SurfaceReconOptions options;
+    options.suppRadius = nArgs > 2 ? atof(args[2]) : 0.05;
+    options.mcubeDivs = nArgs > 3 ? atoi(args[3]) : 256;
+    options.voxelSize = nArgs > 7 ? atof(args[7]) : 0.0;
+    if (nArgs > 13) {
+        options.regionMin = Vec3(atof(args[8]), atof(args[9]), atof(args[10]));
+        options.regionMax = Vec3(atof(args[11]), atof(args[12]), atof(args[13]));
+    }
+
+    const std::string evalName = nArgs > 6 ? args[6] : "gather";
+    if (evalName == "splat") {
+        options.gridEvaluation = GridEvaluation::Splat;
+    } else if (evalName == "band") {
+        options.gridEvaluation = GridEvaluation::NarrowBand;
+    } else if (evalName == "lazy") {
+        options.gridEvaluation = GridEvaluation::Lazy;
+    } else if (evalName != "gather") {
+        fprintf(stderr, "Unknown grid evaluation: %s\n", evalName.c_str());
         std::exit(1);
     }
 
-    const double suppRadius = argc > 2 ? atof(argv[2]) : 0.05;
-    const int    mcubeDivs  = argc > 3 ? atoi(argv[3]) : 256;
+    // Solver and system of the point cloud
+    std::unique_ptr<RBFSolver> solver;
+    if (!fromModel) {
+        const std::string storageName = nArgs > 5 ? args[5] : "matrix";
+        if (storageName == "neighbors") {
+            options.storage = RBFSystemStorage::NeighborList;
+        } else if (storageName == "onthefly") {
+            options.storage = RBFSystemStorage::OnTheFly;
+        } else if (storageName == "pu") {
+            options.partitionOfUnity = true;
+        } else if (storageName != "matrix") {
+            fprintf(stderr, "Unknown RBF system: %s\n", storageName.c_str());
+            std::exit(1);
+        }
+
+        if (nArgs > 4) {
+            std::string solverName = args[4];
+            const std::string warmSuffix = "+warm";
+            const bool warmStart = solverName.size() > warmSuffix.size() &&
+                                   solverName.compare(solverName.size() - warmSuffix.size(), warmSuffix.size(),
+                                                      warmSuffix) == 0;
+            if (warmStart) {
+                solverName.erase(solverName.size() - warmSuffix.size());
+            }
+
+            solver = createRBFSolver(parseRBFSolverType(solverName));
+            solver->setWarmStart(warmStart);
+            options.solver = solver.get();
+
+            const std::string warmFile = !saveFile.empty() ? saveFile : (dirname / basename + ".rbf").string();
+            if (warmStart && !options.partitionOfUnity && std::ifstream(warmFile.c_str()).good()) {
+                options.warmStartFile = warmFile;
+            }
+        }
+        options.modelFile = saveFile;
+    } else if (!saveFile.empty()) {
+        fprintf(stderr, "Warning: --save is not used for the *.rbf input\n");
+    }
 
     // Load point cloud data
     std::vector<Vec3> positions;
     std::vector<Vec3> normals;
-    read_off(argv[1], &positions, &normals);
+    if (!fromModel) {
+        read_points(args[1], &positions, &normals);
+    }
 
     // Surface reconstruction
     std::vector<Vec3> vertices;
@@ -32,14 +117,15 @@ int main(int argc, char **argv) {
 
     Timer timer;
     timer.start();
-    surfaceFromPoints(positions, normals, &vertices, &indices, suppRadius, mcubeDivs);
+    if (fromModel) {
+        surfaceFromModel(args[1], &vertices, &indices, options);
+    } else {
+        surfaceFromPoints(positions, normals, &vertices, &indices, options);
+    }
     // surfaceFromPoints(positions, normals, &vertices, &indices, 0.02, 512);  // For buddha dense
     printf("Time: %f sec\n", timer.stop());
 
     // Save output mesh
-    filepath path(argv[1]);
-    const filepath dirname = path.dirname();
-    const filepath basename = path.stem();
     const std::string outfile = (dirname / basename + ".ply").string();
     write_ply(outfile, vertices, indices);
 }
@@ -0,0 +1,263 @@
+#include "partition_of_unity.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <Eigen/Sparse>
+
+#include "common/progress.h"
+#include "rbf_solver.h"
+
+namespace {
+
+// Local systems need enough constraints to determine the linear polynomial
+const int minCellConstraints = 20;
+
+// Octree is not subdivided further even if a leaf has more constraints (e.g., duplicated points)
+const int maxOctreeDepth = 16;
+
+}  // anonymous namespace
+
+PartitionOfUnityRBF::PartitionOfUnityRBF(const std::vector<Vec3> &xyz, const std::vector<double> &fvals,
+                                         const KDTree<Point> &tree, double suppRadius, const RBFSolver &solver,
+                                         int cellCapacity, double overlap)
+    : suppRadius(suppRadius)
+    , cellCapacity(cellCapacity)
+    , overlap(overlap) {
+    // Bounding cube of the constraints
+    Vec3 bmin(1.0e20), bmax(-1.0e20);
+    for (const auto &p : xyz) {
+        bmin = Vec3(std::min(bmin.x, p.x), std::min(bmin.y, p.y), std::min(bmin.z, p.z));
+        bmax = Vec3(std::max(bmax.x, p.x), std::max(bmax.y, p.y), std::max(bmax.z, p.z));
+    }
+    const double extent = std::max(bmax.x - bmin.x, std::max(bmax.y - bmin.y, bmax.z - bmin.z));
+
+    std::vector<int> indices(xyz.size());
+    for (size_t i = 0; i < xyz.size(); i++) {
+        indices[i] = (int)i;
+    }
+    buildNode(xyz, (bmin + bmax) * 0.5, extent * 0.5 * 1.001, 0, indices);
+
+    // Solve the local systems
+    const int nCells = (int)cells.size();
+    int nFailed = 0;
+    int nRetried = 0;
+    ProgressBar pbar(nCells);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int c = 0; c < nCells; c++) {
+        bool retried = false;
+        if (!solveCell(xyz, fvals, tree, solver, cells[c], &retried)) {
+            #ifdef _OPENMP
+            #pragma omp atomic
+            #endif
+            nFailed++;
+        }
+        if (retried) {
+            #ifdef _OPENMP
+            #pragma omp atomic
+            #endif
+            nRetried++;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        pbar.step();
+    }
+
+    printf("#cells: %d\n", nCells);
+    if (nRetried != 0) {
+        fprintf(stderr, "Warning: local systems of %d cells did not converge with %s (solved again by SchurLDLT)\n",
+                nRetried, solver.name());
+    }
+    if (nFailed != 0) {
+        fprintf(stderr, "Warning: local systems of %d cells are not solved\n", nFailed);
+    }
+}
+
+int PartitionOfUnityRBF::buildNode(const std::vector<Vec3> &xyz, const Vec3 &center, double halfSize, int depth,
+                                   std::vector<int> &indices) {
+    const int id = (int)nodes.size();
+    nodes.emplace_back();
+    nodes[id].center = center;
+    nodes[id].halfSize = halfSize;
+    nodes[id].radius = overlap * std::sqrt(3.0) * halfSize;
+
+    if ((int)indices.size() <= cellCapacity || depth >= maxOctreeDepth) {
+        Cell cell;
+        cell.center = center;
+        cell.radius = nodes[id].radius;
+        nodes[id].cell = (int)cells.size();
+        cells.push_back(std::move(cell));
+        return id;
+    }
+
+    // The children are visited in the fixed order, so the blending does not depend on the threads
+    std::vector<int> childIndices[8];
+    for (int i : indices) {
+        const Vec3 &p = xyz[i];
+        const int octant = (p.x >= center.x ? 1 : 0) | (p.y >= center.y ? 2 : 0) | (p.z >= center.z ? 4 : 0);
+        childIndices[octant].push_back(i);
+    }
+    std::vector<int>().swap(indices);
+
+    for (int k = 0; k < 8; k++) {
+        const double h = halfSize * 0.5;
+        const Vec3 offset((k & 1) ? h : -h, (k & 2) ? h : -h, (k & 4) ? h : -h);
+        const int child = buildNode(xyz, center + offset, h, depth + 1, childIndices[k]);
+        nodes[id].children[k] = child;
+    }
+    return id;
+}
+
+bool PartitionOfUnityRBF::solveCell(const std::vector<Vec3> &xyz, const std::vector<double> &fvals,
+                                    const KDTree<Point> &tree, const RBFSolver &solver, Cell &cell,
+                                    bool *retried) const {
+    // Constraints inside the sphere. Sparse (or empty) leaves take the constraints from a larger sphere
+    // only to fit the local function, and the blending weights keep the original sphere.
+    std::vector<Point> found;
+    double radius = cell.radius;
+    for (;;) {
+        found.clear();
+        tree.insideBall(cell.center, radius, &found);
+        if ((int)found.size() >= minCellConstraints || radius > 4.0) {
+            break;
+        }
+        radius *= 1.5;
+    }
+
+    if ((int)found.size() < minCellConstraints) {
+        return false;
+    }
+
+    std::sort(found.begin(), found.end(), [](const Point &p, const Point &q) { return p.i < q.i; });
+
+    // Too many constraints are gathered only for the enlarged spheres, where evenly taken ones are enough
+    const int maxConstraints = 8 * cellCapacity;
+    if ((int)found.size() > maxConstraints) {
+        std::vector<Point> picked(maxConstraints);
+        for (int k = 0; k < maxConstraints; k++) {
+            picked[k] = found[(size_t)k * found.size() / maxConstraints];
+        }
+        found.swap(picked);
+    }
+
+    const int64_t n = (int64_t)found.size();
+    std::vector<Point> points(n);
+    cell.positions.resize(n);
+    Eigen::VectorXd bb = Eigen::VectorXd::Zero(n + 4);
+    for (int64_t i = 0; i < n; i++) {
+        cell.positions[i] = xyz[found[i].i];
+        points[i] = Point(cell.positions[i], (int)i);
+        bb(i) = fvals[found[i].i];
+    }
+    cell.tree.reset(new KDTree<Point>());
+    cell.tree->construct(points);
+
+    // Local system, which is small enough to be assembled from triplets
+    RBFSparseMatrix AA(n + 4, n + 4);
+
+    // {{ NOT_IMPL_ERROR();
+    std::vector<Eigen::Triplet<double, int64_t>> triplets;
+    std::vector<Point> knn;
+    for (int64_t i = 0; i < n; i++) {
+        knn.clear();
+        cell.tree->insideBall(points[i], suppRadius, &knn);
+        for (const auto &v : knn) {
+            triplets.emplace_back(i, v.i, csrbf(points[i], v, suppRadius));
+        }
+
+        const double pos[4] = {points[i].x, points[i].y, points[i].z, 1.0};
+        for (int64_t j = 0; j < 4; j++) {
+            triplets.emplace_back(i, n + j, pos[j]);
+            triplets.emplace_back(n + j, i, pos[j]);
+        }
+    }
+
+    AA.setFromTriplets(triplets.begin(), triplets.end());
+    // }}
+
+    const auto localSolver = solver.clone();
+    RBFSolverReport report = localSolver->solve(AA, bb, &cell.weights);
+
+    // Iterative backends may stall on the local systems, which are small enough for the direct solver
+    *retried = false;
+    if (!report.success) {
+        Eigen::VectorXd weights;
+        const RBFSolverReport direct = createRBFSolver(RBFSolverType::SchurLDLT)->solve(AA, bb, &weights);
+        if (std::isfinite(direct.residual) && !(report.residual <= direct.residual)) {
+            report = direct;
+            cell.weights.swap(weights);
+        }
+        *retried = true;
+    }
+
+    // The leaf drops out only if neither solution is finite
+    if (!std::isfinite(report.residual) || !cell.weights.allFinite()) {
+        cell.weights.resize(0);
+        cell.tree.reset();
+        return false;
+    }
+    return true;
+}
+
+double PartitionOfUnityRBF::value(const Vec3 &pos, std::vector<Point> *knn) const {
+    double sumValues = 0.0;
+    double sumWeights = 0.0;
+
+    // A sphere of the node contains the spheres of its children when "overlap >= 1"
+    int stack[8 * maxOctreeDepth + 8];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node &node = nodes[stack[--top]];
+        if (length(pos - node.center) >= node.radius) {
+            continue;
+        }
+
+        if (node.cell < 0) {
+            for (int k = 7; k >= 0; k--) {
+                stack[top++] = node.children[k];
+            }
+            continue;
+        }
+
+        const Cell &cell = cells[node.cell];
+        if (cell.weights.size() == 0) {
+            continue;
+        }
+
+        const double w = csrbf(pos, cell.center, cell.radius);
+        if (w <= 0.0) {
+            continue;
+        }
+
+        const int64_t n = (int64_t)cell.positions.size();
+        double value = 0.0;
+
+        // {{ NOT_IMPL_ERROR();
+        knn->clear();
+        cell.tree->insideBall(pos, suppRadius, knn);
+        for (const auto &v : *knn) {
+            value += cell.weights(v.i) * csrbf(pos, v, suppRadius);
+        }
+        value += cell.weights(n + 0) * pos.x;
+        value += cell.weights(n + 1) * pos.y;
+        value += cell.weights(n + 2) * pos.z;
+        value += cell.weights(n + 3);
+        // }}
+
+        sumValues += w * value;
+        sumWeights += w;
+    }
+
+    return sumWeights > 0.0 ? sumValues / sumWeights : 1.0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "common/kdtree.h"
+#include "common/vec3.h"
+#include "csrbf.h"
+
+class RBFSolver;
+
+//! Partition-of-unity CS-RBF implicit function.
+//! The domain is split into an octree whose leaves hold at most "cellCapacity" constraints, and a small
+//! CS-RBF system is solved for each leaf over the constraints inside the sphere of the leaf. The sphere is
+//! "overlap" times as large as the circumsphere of the leaf, so that the spheres of the neighboring leaves
+//! overlap, and the local functions are blended with the weights "csrbf(x, center, radius)" of the spheres.
+class PartitionOfUnityRBF {
+public:
+    //! "tree" is the KD tree of "xyz", whose point indices are those of "xyz". The local systems are
+    //! solved in parallel with the clones of "solver" (and SchurLDLT for those it does not converge on).
+    PartitionOfUnityRBF(const std::vector<Vec3> &xyz, const std::vector<double> &fvals, const KDTree<Point> &tree,
+                        double suppRadius, const RBFSolver &solver, int cellCapacity = 150, double overlap = 1.1);
+
+    //! Value of the implicit function at "pos" ("knn" is a buffer for the neighbor search).
+    //! The outside value 1.0 is returned where no local function is defined.
+    double value(const Vec3 &pos, std::vector<Point> *knn) const;
+
+    int numCells() const {
+        return (int)cells.size();
+    }
+
+private:
+    struct Node {
+        Vec3 center;
+        double halfSize = 0.0;
+        double radius = 0.0;  // radius of the sphere
+        int children[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+        int cell = -1;        // index of the local function for the leaf
+    };
+
+    struct Cell {
+        Vec3 center;
+        double radius = 0.0;
+        std::vector<Vec3> positions;
+        std::unique_ptr<KDTree<Point>> tree;
+        Eigen::VectorXd weights;  // empty if the local system is not solved
+    };
+
+    int buildNode(const std::vector<Vec3> &xyz, const Vec3 &center, double halfSize, int depth,
+                  std::vector<int> &indices);
+    //! Solve the local system of "cell". If "solver" does not converge, the system is solved again by the
+    //! direct SchurLDLT ("retried"), and the better solution is kept. False if the cell has no usable solution.
+    bool solveCell(const std::vector<Vec3> &xyz, const std::vector<double> &fvals, const KDTree<Point> &tree,
+                   const RBFSolver &solver, Cell &cell, bool *retried) const;
+
+    const double suppRadius;
+    const int cellCapacity;
+    const double overlap;
+    std::vector<Node> nodes;
+    std::vector<Cell> cells;
+};
@@ -0,0 +1,75 @@
+#include "rbf_model.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+const char modelMagic[8] = { 'C', 'S', 'R', 'B', 'F', '\0', '\0', '\0' };
+const uint32_t modelVersion = 1;
+
+}  // namespace
+
+void RBFModel::open(const std::string &filename) {
+    file.open(filename);
+    header = nullptr;
+    centers = nullptr;
+    weights_ = nullptr;
+
+    if (file.size() < sizeof(Header)) {
+        throw std::runtime_error("Invalid RBF model file: " + filename);
+    }
+
+    const Header *h = (const Header *)file.data();
+    if (std::memcmp(h->magic, modelMagic, sizeof(modelMagic)) != 0 || h->version != modelVersion) {
+        throw std::runtime_error("Invalid RBF model file: " + filename);
+    }
+
+    const uint64_t N = h->numCenters;
+    const uint64_t expected = sizeof(Header) + (3 * N + N + 4) * sizeof(double);
+    if (N > (file.size() - sizeof(Header)) / (4 * sizeof(double)) || file.size() != expected) {
+        throw std::runtime_error("Corrupted RBF model file: " + filename);
+    }
+
+    // The header is a multiple of 8 bytes, so the arrays are aligned in the page-aligned mapping
+    header = h;
+    centers = (const double *)(file.data() + sizeof(Header));
+    weights_ = centers + 3 * N;
+}
+
+void RBFModel::save(const std::string &filename, const std::vector<Vec3> &centers, const Eigen::VectorXd &weights,
+                    double suppRadius, const Vec3 &center, double scale, const double extents[3]) {
+    static_assert(sizeof(Header) % sizeof(double) == 0, "Header must keep the arrays aligned");
+    if (weights.size() != (Eigen::Index)centers.size() + 4) {
+        throw std::runtime_error("The weights do not match the centers of the RBF model!");
+    }
+
+    std::ofstream writer(filename.c_str(), std::ios::out | std::ios::binary);
+    if (writer.fail()) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    Header header;
+    std::memset(&header, 0, sizeof(Header));
+    std::memcpy(header.magic, modelMagic, sizeof(modelMagic));
+    header.version = modelVersion;
+    header.numCenters = centers.size();
+    header.suppRadius = suppRadius;
+    for (int i = 0; i < 3; i++) {
+        header.center[i] = center[i];
+        header.extents[i] = extents[i];
+    }
+    header.scale = scale;
+    writer.write((const char *)&header, sizeof(Header));
+
+    for (const auto &c : centers) {
+        const double xyz[3] = { c.x, c.y, c.z };
+        writer.write((const char *)xyz, sizeof(xyz));
+    }
+    writer.write((const char *)weights.data(), sizeof(double) * weights.size());
+
+    if (writer.fail()) {
+        throw std::runtime_error("Failed to write file: " + filename);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "common/mmap.h"
+#include "common/vec3.h"
+
+//! Solved global CS-RBF function, which is saved to a binary file so that the surface can be extracted again
+//! at another resolution or in a sub-region without solving the system. The file is memory-mapped, and the
+//! weights are used in place.
+//!
+//! Layout (little-endian): the header, the centers (3 doubles each, normalized coordinates, in the order of the
+//! constraints), and the weights of the centers followed by the 4 coefficients of the linear polynomial term.
+class RBFModel {
+public:
+    struct Header {
+        char magic[8];        // "CSRBF\0\0\0"
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t numCenters;
+        double suppRadius;    // support radius in the normalized coordinates
+        double center[3];     // input coordinates = normalized coordinates * scale + center
+        double scale;
+        double extents[3];    // extents of the bounding box of the input points
+    };
+
+    RBFModel() = default;
+
+    explicit RBFModel(const std::string &filename) {
+        open(filename);
+    }
+
+    //! Map the model file. "std::runtime_error" is thrown if the file is not a valid model.
+    void open(const std::string &filename);
+
+    static void save(const std::string &filename, const std::vector<Vec3> &centers, const Eigen::VectorXd &weights,
+                     double suppRadius, const Vec3 &center, double scale, const double extents[3]);
+
+    int64_t numCenters() const {
+        return (int64_t)header->numCenters;
+    }
+
+    Vec3 centerAt(int64_t i) const {
+        const double *p = centers + 3 * i;
+        return Vec3(p[0], p[1], p[2]);
+    }
+
+    //! Weights of the centers and the linear polynomial term ("numCenters() + 4" entries)
+    Eigen::Map<const Eigen::VectorXd> weights() const {
+        return Eigen::Map<const Eigen::VectorXd>(weights_, header->numCenters + 4);
+    }
+
+    const Header &info() const {
+        return *header;
+    }
+
+private:
+    MappedFile file;
+    const Header *header = nullptr;
+    const double *centers = nullptr;
+    const double *weights_ = nullptr;
+};
@@ -0,0 +1,378 @@
+#include "rbf_solver.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+
+#include <Eigen/Dense>
+#include <Eigen/IterativeLinearSolvers>
+#include <Eigen/SparseCholesky>
+#include <Eigen/SparseLU>
+#include <unsupported/Eigen/IterativeSolvers>
+
+#include "common/timer.h"
+
+constexpr int RBFSolver::numPolyTerms;
+
+void RBFSolver::initialGuess(int64_t size, Eigen::VectorXd *x) const {
+    if (warmStart && previous.size() == size) {
+        *x = previous;
+    } else {
+        *x = Eigen::VectorXd::Zero(size);
+    }
+}
+
+std::unique_ptr<RBFSolver> RBFSolver::withState(RBFSolver *solver) const {
+    solver->warmStart = warmStart;
+    solver->previous = previous;
+    return std::unique_ptr<RBFSolver>(solver);
+}
+
+void RBFSolver::finish(double residual, const Eigen::VectorXd &x, RBFSolverReport *report) {
+    report->residual = residual;
+    if (!std::isfinite(report->residual)) {
+        report->success = false;
+    }
+
+    if (report->success) {
+        previous = x;
+    }
+}
+
+RBFSolverReport RBFSolver::solve(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x) {
+    Timer timer;
+    timer.start();
+    initialGuess(b.size(), x);
+
+    RBFSolverReport report;
+    report.method = name();
+    report.iterations = solveImpl(A, b, x, &report.success);
+    report.seconds = timer.stop();
+
+    const double bnorm = b.norm();
+    finish((b - A * (*x)).norm() / (bnorm != 0.0 ? bnorm : 1.0), *x, &report);
+    return report;
+}
+
+RBFSolverReport RBFSolver::solve(const RBFOperator &A, const Eigen::VectorXd &b, Eigen::VectorXd *x) {
+    if (!supportsMatrixFree()) {
+        throw std::runtime_error(std::string(name()) + " does not support the matrix-free system!");
+    }
+
+    Timer timer;
+    timer.start();
+    initialGuess(b.size(), x);
+
+    RBFSolverReport report;
+    report.method = matrixFreeName();
+    report.iterations = solveMatrixFreeImpl(A, b, x, &report.success);
+    report.seconds = timer.stop();
+
+    Eigen::VectorXd Ax;
+    A.apply(*x, &Ax);
+    const double bnorm = b.norm();
+    finish((b - Ax).norm() / (bnorm != 0.0 ? bnorm : 1.0), *x, &report);
+    return report;
+}
+
+int64_t RBFSolver::solveMatrixFreeImpl(const RBFOperator &, const Eigen::VectorXd &, Eigen::VectorXd *, bool *) {
+    throw std::runtime_error(std::string(name()) + " does not support the matrix-free system!");
+}
+
+// Wrapper of RBFOperator for Eigen's iterative solvers
+// See: https://eigen.tuxfamily.org/dox/group__MatrixfreeSolverExample.html
+class RBFOperatorMatrix;
+
+namespace Eigen {
+namespace internal {
+
+template <>
+struct traits<RBFOperatorMatrix> : public traits<SparseMatrix<double>> {};
+
+}  // namespace internal
+}  // namespace Eigen
+
+class RBFOperatorMatrix : public Eigen::EigenBase<RBFOperatorMatrix> {
+public:
+    using Scalar = double;
+    using RealScalar = double;
+    using StorageIndex = int64_t;
+    enum {
+        ColsAtCompileTime = Eigen::Dynamic,
+        MaxColsAtCompileTime = Eigen::Dynamic,
+        IsRowMajor = false
+    };
+
+    explicit RBFOperatorMatrix(const RBFOperator &op)
+        : op(op) {
+    }
+
+    Eigen::Index rows() const {
+        return op.size();
+    }
+
+    Eigen::Index cols() const {
+        return op.size();
+    }
+
+    template <typename Rhs>
+    Eigen::Product<RBFOperatorMatrix, Rhs, Eigen::AliasFreeProduct> operator*(const Eigen::MatrixBase<Rhs> &x) const {
+        return Eigen::Product<RBFOperatorMatrix, Rhs, Eigen::AliasFreeProduct>(*this, x.derived());
+    }
+
+    const RBFOperator &op;
+};
+
+namespace Eigen {
+namespace internal {
+
+template <typename Rhs>
+struct generic_product_impl<RBFOperatorMatrix, Rhs, SparseShape, DenseShape, GemvProduct>
+    : generic_product_impl_base<RBFOperatorMatrix, Rhs, generic_product_impl<RBFOperatorMatrix, Rhs>> {
+    template <typename Dest>
+    static void scaleAndAddTo(Dest &dst, const RBFOperatorMatrix &lhs, const Rhs &rhs, const double &alpha) {
+        const VectorXd x = rhs;
+        VectorXd y;
+        lhs.op.apply(x, &y);
+        dst += alpha * y;
+    }
+};
+
+}  // namespace internal
+}  // namespace Eigen
+
+namespace {
+
+template <typename Preconditioner>
+void setupPreconditioner(Preconditioner &) {
+}
+
+//! Eigen's default drop tolerance is close to the machine epsilon, which amounts to the complete LU
+//! for the CS-RBF matrix. Small entries are dropped, as the Krylov solver fixes the remaining error.
+//! (With 1e-3 or larger, the factorization breaks down due to the zero block of the polynomial terms.)
+void setupPreconditioner(Eigen::IncompleteLUT<double, int64_t> &ilut) {
+    ilut.setDroptol(1.0e-4);
+    ilut.setFillfactor(10);
+}
+
+//! Inverse of the diagonal of the operator, where zeros (of the polynomial terms) are replaced with ones
+class RBFJacobiPreconditioner {
+public:
+    RBFJacobiPreconditioner() = default;
+
+    RBFJacobiPreconditioner &analyzePattern(const RBFOperatorMatrix &) {
+        return *this;
+    }
+
+    RBFJacobiPreconditioner &factorize(const RBFOperatorMatrix &mat) {
+        invDiag = mat.op.diagonal();
+        for (Eigen::Index i = 0; i < invDiag.size(); i++) {
+            invDiag(i) = invDiag(i) != 0.0 ? 1.0 / invDiag(i) : 1.0;
+        }
+        return *this;
+    }
+
+    RBFJacobiPreconditioner &compute(const RBFOperatorMatrix &mat) {
+        return factorize(mat);
+    }
+
+    template <typename Rhs>
+    Eigen::VectorXd solve(const Eigen::MatrixBase<Rhs> &b) const {
+        return invDiag.cwiseProduct(b);
+    }
+
+    Eigen::ComputationInfo info() const {
+        return Eigen::Success;
+    }
+
+private:
+    Eigen::VectorXd invDiag;
+};
+
+template <typename Solver, typename Matrix>
+int64_t solveIterative(const Matrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x, bool *success,
+                       int maxIters, double tolerance) {
+    Solver solver;
+    solver.setMaxIterations(maxIters);
+    solver.setTolerance(tolerance);
+    setupPreconditioner(solver.preconditioner());
+    solver.compute(A);
+    if (solver.info() != Eigen::Success) {
+        *success = false;
+        return 0;
+    }
+
+    const Eigen::VectorXd guess = *x;
+    *x = solver.solveWithGuess(b, guess);
+    *success = solver.info() == Eigen::Success;
+    return (int64_t)solver.iterations();
+}
+
+template <typename Solver>
+int64_t solveMatrixFree(const RBFOperator &A, const Eigen::VectorXd &b, Eigen::VectorXd *x, bool *success,
+                        int maxIters, double tolerance) {
+    return solveIterative<Solver>(RBFOperatorMatrix(A), b, x, success, maxIters, tolerance);
+}
+
+template <>
+int64_t solveMatrixFree<void>(const RBFOperator &, const Eigen::VectorXd &, Eigen::VectorXd *, bool *, int, double) {
+    throw std::runtime_error("The matrix-free system is not supported!");
+}
+
+//! Krylov solvers of Eigen, which share the same interface. "MatrixFreeSolver" is the same method
+//! for the matrix-free system, or "void" if it is not supported (e.g., for the ILUT preconditioner).
+//! It is always preconditioned with the diagonal, so it is reported as "matrixFreeName".
+template <typename Solver, typename MatrixFreeSolver>
+class IterativeRBFSolver : public RBFSolver {
+public:
+    IterativeRBFSolver(const char *solverName, const char *matrixFreeSolverName, int maxIters, double tolerance)
+        : RBFSolver(maxIters, tolerance)
+        , solverName(solverName)
+        , matrixFreeSolverName(matrixFreeSolverName) {
+    }
+
+    const char *name() const override {
+        return solverName;
+    }
+
+    const char *matrixFreeName() const override {
+        return matrixFreeSolverName;
+    }
+
+    std::unique_ptr<RBFSolver> clone() const override {
+        return withState(new IterativeRBFSolver(solverName, matrixFreeSolverName, maxIters, tolerance));
+    }
+
+    bool supportsMatrixFree() const override {
+        return !std::is_void<MatrixFreeSolver>::value;
+    }
+
+protected:
+    int64_t solveImpl(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                      bool *success) override {
+        return solveIterative<Solver>(A, b, x, success, maxIters, tolerance);
+    }
+
+    int64_t solveMatrixFreeImpl(const RBFOperator &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                                bool *success) override {
+        return solveMatrixFree<MatrixFreeSolver>(A, b, x, success, maxIters, tolerance);
+    }
+
+private:
+    const char *solverName;
+    const char *matrixFreeSolverName;
+};
+
+class SparseLURBFSolver : public RBFSolver {
+public:
+    using RBFSolver::RBFSolver;
+
+    const char *name() const override {
+        return "SparseLU";
+    }
+
+    std::unique_ptr<RBFSolver> clone() const override {
+        return withState(new SparseLURBFSolver(maxIters, tolerance));
+    }
+
+protected:
+    int64_t solveImpl(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                      bool *success) override {
+        Eigen::SparseLU<RBFSparseMatrix, Eigen::COLAMDOrdering<int64_t>> solver;
+        solver.compute(A);
+        if (solver.info() != Eigen::Success) {
+            *success = false;
+            return 0;
+        }
+
+        *x = solver.solve(b);
+        *success = solver.info() == Eigen::Success;
+        return 0;
+    }
+};
+
+//! The saddle-point system is reduced to the positive definite kernel matrix "K" and a small Schur complement:
+//!   (P^T K^-1 P) c = P^T K^-1 f,  w = K^-1 (f - P c)
+//! so that only "K" needs to be factorized, without pivoting for the zero block.
+class SchurLDLTRBFSolver : public RBFSolver {
+public:
+    using RBFSolver::RBFSolver;
+
+    const char *name() const override {
+        return "SchurLDLT";
+    }
+
+    std::unique_ptr<RBFSolver> clone() const override {
+        return withState(new SchurLDLTRBFSolver(maxIters, tolerance));
+    }
+
+protected:
+    int64_t solveImpl(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                      bool *success) override {
+        const int64_t N = A.rows() - numPolyTerms;
+        const RBFSparseMatrix K = A.topLeftCorner(N, N);
+        const Eigen::MatrixXd P = Eigen::MatrixXd(A.block(0, N, N, numPolyTerms));
+
+        Eigen::SimplicialLDLT<RBFSparseMatrix> solver;
+        solver.compute(K);
+        if (solver.info() != Eigen::Success) {
+            *success = false;
+            return 0;
+        }
+
+        // K^-1 [P f]
+        Eigen::MatrixXd rhs(N, numPolyTerms + 1);
+        rhs.leftCols(numPolyTerms) = P;
+        rhs.col(numPolyTerms) = b.head(N);
+        const Eigen::MatrixXd Y = solver.solve(rhs);
+
+        const Eigen::MatrixXd S = P.transpose() * Y.leftCols(numPolyTerms);
+        const Eigen::VectorXd r = P.transpose() * Y.col(numPolyTerms) - b.tail(numPolyTerms);
+        const Eigen::VectorXd c = S.fullPivLu().solve(r);
+
+        x->resize(N + numPolyTerms);
+        x->head(N) = Y.col(numPolyTerms) - Y.leftCols(numPolyTerms) * c;
+        x->tail(numPolyTerms) = c;
+        *success = solver.info() == Eigen::Success;
+        return 0;
+    }
+};
+
+using BiCGSTABSolver = Eigen::BiCGSTAB<RBFSparseMatrix>;
+using BiCGSTABMatrixFreeSolver = Eigen::BiCGSTAB<RBFOperatorMatrix, RBFJacobiPreconditioner>;
+using BiCGSTABILUTSolver = Eigen::BiCGSTAB<RBFSparseMatrix, Eigen::IncompleteLUT<double, int64_t>>;
+using GMRESSolver = Eigen::GMRES<RBFSparseMatrix, Eigen::IncompleteLUT<double, int64_t>>;
+using GMRESMatrixFreeSolver = Eigen::GMRES<RBFOperatorMatrix, RBFJacobiPreconditioner>;
+
+}  // anonymous namespace
+
+std::unique_ptr<RBFSolver> createRBFSolver(RBFSolverType type, int maxIters, double tolerance) {
+    switch (type) {
+    case RBFSolverType::BiCGSTAB:
+        return std::unique_ptr<RBFSolver>(
+            new IterativeRBFSolver<BiCGSTABSolver, BiCGSTABMatrixFreeSolver>("BiCGSTAB", "BiCGSTAB", maxIters,
+                                                                             tolerance));
+    case RBFSolverType::BiCGSTAB_ILUT:
+        return std::unique_ptr<RBFSolver>(
+            new IterativeRBFSolver<BiCGSTABILUTSolver, void>("BiCGSTAB (ILUT)", "BiCGSTAB (ILUT)", maxIters,
+                                                             tolerance));
+    case RBFSolverType::GMRES:
+        return std::unique_ptr<RBFSolver>(
+            new IterativeRBFSolver<GMRESSolver, GMRESMatrixFreeSolver>("GMRES (ILUT)", "GMRES (Jacobi)", maxIters,
+                                                                       tolerance));
+    case RBFSolverType::SparseLU:
+        return std::unique_ptr<RBFSolver>(new SparseLURBFSolver(maxIters, tolerance));
+    case RBFSolverType::SchurLDLT:
+        return std::unique_ptr<RBFSolver>(new SchurLDLTRBFSolver(maxIters, tolerance));
+    }
+    throw std::runtime_error("Unknown RBF solver type!");
+}
+
+RBFSolverType parseRBFSolverType(const std::string &name) {
+    if (name == "bicgstab") return RBFSolverType::BiCGSTAB;
+    if (name == "ilut") return RBFSolverType::BiCGSTAB_ILUT;
+    if (name == "gmres") return RBFSolverType::GMRES;
+    if (name == "lu") return RBFSolverType::SparseLU;
+    if (name == "ldlt") return RBFSolverType::SchurLDLT;
+    throw std::runtime_error("Unknown RBF solver: " + name);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+
+using RBFSparseMatrix = Eigen::SparseMatrix<double, Eigen::ColMajor, int64_t>;
+
+enum class RBFSolverType {
+    BiCGSTAB = 0x00,      //!< BiCGSTAB with the diagonal preconditioner
+    BiCGSTAB_ILUT = 0x01, //!< BiCGSTAB with the incomplete LU preconditioner
+    GMRES = 0x02,         //!< Restarted GMRES with the incomplete LU (or diagonal for matrix-free) preconditioner
+    SparseLU = 0x03,      //!< Direct sparse LU of the whole system
+    SchurLDLT = 0x04,     //!< Direct sparse LDLT of the RBF block and the Schur complement of the polynomial terms
+};
+
+//! Statistics of a linear solve. "residual" is the relative residual "|b - A x| / |b|",
+//! which is evaluated in the same way for all the backends.
+struct RBFSolverReport {
+    const char *method = "";  //!< Backend and preconditioner actually used for the system
+    double seconds = 0.0;
+    int64_t iterations = 0;
+    double residual = 0.0;
+    bool success = false;
+};
+
+//! CS-RBF system matrix which is applied on the fly without storing its entries
+class RBFOperator {
+public:
+    virtual ~RBFOperator() = default;
+
+    //! Number of rows (and columns), including the polynomial terms
+    virtual int64_t size() const = 0;
+
+    //! y = A x
+    virtual void apply(const Eigen::VectorXd &x, Eigen::VectorXd *y) const = 0;
+
+    //! Diagonal entries of A
+    virtual Eigen::VectorXd diagonal() const = 0;
+};
+
+//! Solver for the CS-RBF system "[K P; P^T 0] [w; c] = [f; 0]", where "K" is the symmetric kernel
+//! matrix and the last "numPolyTerms" rows and columns are the linear polynomial terms "P = [x y z 1]".
+class RBFSolver {
+public:
+    static constexpr int numPolyTerms = 4;
+
+    RBFSolver(int maxIters, double tolerance)
+        : maxIters(maxIters)
+        , tolerance(tolerance) {
+    }
+    virtual ~RBFSolver() = default;
+
+    virtual const char *name() const = 0;
+
+    //! Name for the matrix-free system, whose preconditioner may differ from the assembled one
+    virtual const char *matrixFreeName() const {
+        return name();
+    }
+
+    //! New solver of the same backend, parameters and warm-start state, e.g., for the systems solved in parallel
+    virtual std::unique_ptr<RBFSolver> clone() const = 0;
+
+    //! Solve the system. If warm start is enabled, iterative backends start from the solution of
+    //! the previous call with the same size (e.g., when the constraints are only slightly changed).
+    RBFSolverReport solve(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x);
+
+    //! Same as above for the matrix-free system, which only the Krylov backends support.
+    //! They are preconditioned with the diagonal of the operator.
+    RBFSolverReport solve(const RBFOperator &A, const Eigen::VectorXd &b, Eigen::VectorXd *x);
+
+    virtual bool supportsMatrixFree() const {
+        return false;
+    }
+
+    void setWarmStart(bool enable) {
+        warmStart = enable;
+    }
+
+    bool isWarmStart() const {
+        return warmStart;
+    }
+
+    //! Initial guess of the next solve with warm start, e.g., the weights of a saved model
+    void setInitialGuess(const Eigen::VectorXd &x) {
+        previous = x;
+    }
+
+protected:
+    //! Solve the system from the initial guess "x", and return the number of iterations.
+    virtual int64_t solveImpl(const RBFSparseMatrix &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                              bool *success) = 0;
+    virtual int64_t solveMatrixFreeImpl(const RBFOperator &A, const Eigen::VectorXd &b, Eigen::VectorXd *x,
+                                        bool *success);
+
+    //! Take the new solver of "clone" with the warm-start state of this one
+    std::unique_ptr<RBFSolver> withState(RBFSolver *solver) const;
+
+    int maxIters;
+    double tolerance;
+
+private:
+    void initialGuess(int64_t size, Eigen::VectorXd *x) const;
+    void finish(double residual, const Eigen::VectorXd &x, RBFSolverReport *report);
+
+    bool warmStart = false;
+    Eigen::VectorXd previous;
+};
+
+//! Create a solver backend. "maxIters" and "tolerance" are used only by the iterative backends.
+std::unique_ptr<RBFSolver> createRBFSolver(RBFSolverType type, int maxIters = 500, double tolerance = 1.0e-12);
+
+//! Solver type from its name, i.e., "bicgstab", "ilut", "gmres", "lu" or "ldlt".
+RBFSolverType parseRBFSolverType(const std::string &name);
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <random>
 #include <algorithm>
+#include <memory>
+#include <array>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -11,39 +13,543 @@
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 
+#include "rbf_solver.h"
+
 using FloatType = double;
 using IndexType = int64_t;
 using EigenMatrix = Eigen::MatrixXd;
 using EigenVector = Eigen::VectorXd;
-using SparseMatrix = Eigen::SparseMatrix<FloatType, Eigen::ColMajor, IndexType>;
-using Triplet = Eigen::Triplet<FloatType, IndexType>;
+using SparseMatrix = RBFSparseMatrix;
 
 #include "common/kdtree.h"
 #include "common/progress.h"
 #include "common/volume.h"
 #include "mcubes/mcubes.h"
+#include "csrbf.h"
+#include "partition_of_unity.h"
+#include "rbf_model.h"
+
+//! Matrix-free CS-RBF system, whose kernel values are evaluated at every product. The neighbors of
+//! each point are either cached (4 bytes per non-zero) or searched in the KD tree again.
+class CSRBFOperator : public RBFOperator {
+public:
+    CSRBFOperator(const std::vector<Vec3> &xyz, const KDTree<Point> &tree, double suppRadius, bool cacheNeighbors)
+        : xyz(xyz)
+        , tree(tree)
+        , suppRadius(suppRadius)
+        , cacheNeighbors(cacheNeighbors) {
+        if (!cacheNeighbors) {
+            return;
+        }
 
-// Wendland's RBF
-// Morse et al. 2001,
-// "Interpolating Implicit Surfaces From Scattered Surface Data
-//  Using Compactly Supported Radial Basis Functions"
-inline double csrbf(const Vec3 &x, const Vec3 &y, double s = 0.1) {
-    const double r = length(x - y) / s;
-    const double a = std::max(0.0, 1.0 - r);
-    const double b = 4.0 * r + 1.0;
-    return (a * a * a * a) * b;
-}
+        // Same chunks as the product, which are concatenated in order
+        const int64_t N = xyz.size();
+        const int64_t nChunks = (N + chunkSize - 1) / chunkSize;
+        std::vector<std::vector<int>> chunkNeighbors(nChunks);
+        offsets.assign(N + 1, 0);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+        #endif
+        for (int64_t c = 0; c < nChunks; c++) {
+            std::vector<Point> knn;
+            const int64_t end = std::min(N, (c + 1) * chunkSize);
+            for (int64_t i = c * chunkSize; i < end; i++) {
+                knn.clear();
+                tree.insideBall(xyz[i], suppRadius, &knn);
+                for (const auto &v : knn) {
+                    chunkNeighbors[c].push_back(v.i);
+                }
+                offsets[i + 1] = knn.size();
+            }
+        }
+
+        for (int64_t i = 0; i < N; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        neighbors.resize(offsets[N]);
+        for (int64_t c = 0; c < nChunks; c++) {
+            std::copy(chunkNeighbors[c].begin(), chunkNeighbors[c].end(), neighbors.begin() + offsets[c * chunkSize]);
+            std::vector<int>().swap(chunkNeighbors[c]);
+        }
+    }
 
-// Custom struct for KD tree
-struct Point : public Vec3 {
-    Point() {}
-    Point(const Vec3 &v, int index = -1) : Vec3(v), i(index) {}
-    int i;
+    int64_t size() const override {
+        return (int64_t)xyz.size() + 4;
+    }
+
+    void apply(const Eigen::VectorXd &x, Eigen::VectorXd *y) const override {
+        const int64_t N = xyz.size();
+        const int64_t nChunks = (N + chunkSize - 1) / chunkSize;
+        std::vector<double> partials(nChunks * 4, 0.0);
+        y->resize(N + 4);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic)
+        #endif
+        for (int64_t c = 0; c < nChunks; c++) {
+            std::vector<Point> knn;
+            double *partial = &partials[c * 4];
+            const int64_t end = std::min(N, (c + 1) * chunkSize);
+            for (int64_t i = c * chunkSize; i < end; i++) {
+                // {{ NOT_IMPL_ERROR();
+                const Vec3 &p = xyz[i];
+                double value = 0.0;
+                if (cacheNeighbors) {
+                    for (int64_t k = offsets[i]; k < offsets[i + 1]; k++) {
+                        const int j = neighbors[k];
+                        value += csrbf(p, xyz[j], suppRadius) * x(j);
+                    }
+                } else {
+                    knn.clear();
+                    tree.insideBall(p, suppRadius, &knn);
+                    for (const auto &v : knn) {
+                        value += csrbf(p, v, suppRadius) * x(v.i);
+                    }
+                }
+                (*y)(i) = value + p.x * x(N + 0) + p.y * x(N + 1) + p.z * x(N + 2) + x(N + 3);
+
+                // Linear polynomial terms (reduced in the chunk order)
+                partial[0] += p.x * x(i);
+                partial[1] += p.y * x(i);
+                partial[2] += p.z * x(i);
+                partial[3] += x(i);
+                // }}
+            }
+        }
+
+        y->tail(4).setZero();
+        for (int64_t c = 0; c < nChunks; c++) {
+            for (int j = 0; j < 4; j++) {
+                (*y)(N + j) += partials[c * 4 + j];
+            }
+        }
+    }
+
+    Eigen::VectorXd diagonal() const override {
+        Eigen::VectorXd diag = Eigen::VectorXd::Zero(size());
+        diag.head(xyz.size()).setConstant(csrbf(Vec3(), Vec3(), suppRadius));
+        return diag;
+    }
+
+    //! Bytes for the cached neighbors
+    size_t memoryBytes() const {
+        return neighbors.size() * sizeof(int) + offsets.size() * sizeof(int64_t);
+    }
+
+private:
+    static constexpr int64_t chunkSize = 4096;
+
+    const std::vector<Vec3> &xyz;
+    const KDTree<Point> &tree;
+    const double suppRadius;
+    const bool cacheNeighbors;
+    std::vector<int64_t> offsets;
+    std::vector<int> neighbors;
+};
+
+constexpr int64_t CSRBFOperator::chunkSize;
+
+//! Lattice points for marching cubes in the normalized coordinates. The spacing is the same along all the axes,
+//! and each axis has as many points as its extent needs. The lattice points are at the integer multiples of the
+//! spacing, and the "offsets[i]"-th point along each axis is at the origin (which may be outside a sub-region).
+struct ReconLattice {
+    std::array<int, 3> sizes;
+    std::array<int, 3> offsets;
+    double divs;  //!< Lattice points per unit length
+
+    double coord(double i, int axis) const {
+        return (i - offsets[axis]) / divs;
+    }
+
+    Vec3 position(double i, double j, double k) const {
+        return Vec3(coord(i, 0), coord(j, 1), coord(k, 2));
+    }
+
+    //! Continuous lattice index of the coordinate "x" along "axis"
+    double index(double x, int axis) const {
+        return x * divs + offsets[axis];
+    }
 };
 
+//! Evaluate the global CS-RBF function at the lattice points by scattering the kernel of each center into
+//! the lattice points inside its support. The lattice is split into slabs along the z-axis, and the centers
+//! overlapping each slab are accumulated in the order of their indices, so that the values do not depend
+//! on the number of threads.
+void splatImplicitFunction(const std::vector<Vec3> &xyz, const Eigen::Ref<const Eigen::VectorXd> &weights,
+                           double suppRadius, const ReconLattice &lattice, FloatVolume *volume) {
+    const int sizeX = lattice.sizes[0], sizeY = lattice.sizes[1], sizeZ = lattice.sizes[2];
+    const int64_t N = xyz.size();
+    const int slabSize = 4;
+    const int nSlabs = (sizeZ + slabSize - 1) / slabSize;
+
+    // Range of the lattice points within "radius" from "x" along an axis
+    const auto lower = [&](double x, double radius, int axis) {
+        return std::max(0, (int)std::ceil(lattice.index(x - radius, axis)));
+    };
+    const auto upper = [&](double x, double radius, int axis) {
+        return std::min(lattice.sizes[axis] - 1, (int)std::floor(lattice.index(x + radius, axis)));
+    };
+
+    // Centers overlapping each slab (bucketed by counting sort)
+    std::vector<int64_t> offsets(nSlabs + 1, 0);
+    for (int64_t c = 0; c < N; c++) {
+        const int kMin = lower(xyz[c].z, suppRadius, 2);
+        const int kMax = upper(xyz[c].z, suppRadius, 2);
+        for (int s = kMin / slabSize; s <= kMax / slabSize && kMin <= kMax; s++) {
+            offsets[s + 1]++;
+        }
+    }
+    for (int s = 0; s < nSlabs; s++) {
+        offsets[s + 1] += offsets[s];
+    }
+
+    std::vector<int> centers(offsets[nSlabs]);
+    std::vector<int64_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (int64_t c = 0; c < N; c++) {
+        const int kMin = lower(xyz[c].z, suppRadius, 2);
+        const int kMax = upper(xyz[c].z, suppRadius, 2);
+        for (int s = kMin / slabSize; s <= kMax / slabSize && kMin <= kMax; s++) {
+            centers[cursors[s]++] = (int)c;
+        }
+    }
+
+    ProgressBar pbar(nSlabs);
+    #ifdef _OPENMP
+    #pragma omp parallel
+    #endif
+    {
+        std::vector<double> buffer((size_t)slabSize * sizeY * sizeX);
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int s = 0; s < nSlabs; s++) {
+            const int k0 = s * slabSize;
+            const int k1 = std::min(sizeZ, k0 + slabSize);
+            std::fill(buffer.begin(), buffer.end(), 0.0);
+
+            for (int64_t t = offsets[s]; t < offsets[s + 1]; t++) {
+                const int c = centers[t];
+                const Vec3 &x = xyz[c];
+                const int kMin = std::max(k0, lower(x.z, suppRadius, 2));
+                const int kMax = std::min(k1 - 1, upper(x.z, suppRadius, 2));
+                const int jMin = lower(x.y, suppRadius, 1);
+                const int jMax = upper(x.y, suppRadius, 1);
+                for (int k = kMin; k <= kMax; k++) {
+                    const double pz = lattice.coord(k, 2);
+                    const double dz = pz - x.z;
+                    for (int j = jMin; j <= jMax; j++) {
+                        const double py = lattice.coord(j, 1);
+                        const double dy = py - x.y;
+                        const double rest = suppRadius * suppRadius - dy * dy - dz * dz;
+                        if (rest <= 0.0) {
+                            continue;
+                        }
+
+                        // Chord of the support along the x-axis
+                        const double chord = std::sqrt(rest);
+                        double *row = &buffer[((size_t)(k - k0) * sizeY + j) * sizeX];
+                        for (int i = lower(x.x, chord, 0); i <= upper(x.x, chord, 0); i++) {
+                            // {{ NOT_IMPL_ERROR();
+                            const Vec3 pos(lattice.coord(i, 0), py, pz);
+                            row[i] += weights(c) * csrbf(pos, x, suppRadius);
+                            // }}
+                        }
+                    }
+                }
+            }
+
+            for (int k = k0; k < k1; k++) {
+                for (int j = 0; j < sizeY; j++) {
+                    const double *row = &buffer[((size_t)(k - k0) * sizeY + j) * sizeX];
+                    for (int i = 0; i < sizeX; i++) {
+                        // {{ NOT_IMPL_ERROR();
+                        const double px = lattice.coord(i, 0);
+                        const double py = lattice.coord(j, 1);
+                        const double pz = lattice.coord(k, 2);
+                        double value = row[i];
+                        value += weights(N + 0) * px;
+                        value += weights(N + 1) * py;
+                        value += weights(N + 2) * pz;
+                        value += weights(N + 3);
+                        (*volume)(i, j, k) = (float)value;
+                        // }}
+                    }
+                }
+            }
+
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            pbar.step();
+        }
+    }
+}
+
+//! Fit the lattice to the bounding box of the input points with "extents", whose largest extent is normalized to
+//! "1.0 / 1.1" by the "scale". Each axis has the same margin (5% of the largest extent on each side), and only the
+//! largest extent has "mcubeDivs" lattice points unless "voxelSize" is given. The lattice is then clipped to the
+//! region of the options, so that the lattice of a sub-region is a part of the whole one.
+ReconLattice fitLattice(const double extents[3], const Vec3 &center, double scale, const SurfaceReconOptions &options) {
+    ReconLattice lattice;
+    lattice.divs = options.voxelSize > 0.0 ? scale / options.voxelSize : options.mcubeDivs;
+    const double margin = scale - std::max(extents[0], std::max(extents[1], extents[2]));
+    for (int i = 0; i < 3; i++) {
+        lattice.sizes[i] = std::max(2, (int)std::ceil((extents[i] + margin) / scale * lattice.divs - 1.0e-6));
+        lattice.offsets[i] = lattice.sizes[i] / 2;
+
+        const double lower = std::ceil(lattice.index((options.regionMin[i] - center[i]) / scale, i));
+        const double upper = std::floor(lattice.index((options.regionMax[i] - center[i]) / scale, i));
+        const int first = (int)std::max(0.0, lower);
+        const int last = (int)std::min(lattice.sizes[i] - 1.0, upper);
+        if (last - first < 1) {
+            throw std::runtime_error("The region to reconstruct does not overlap the points!");
+        }
+        lattice.sizes[i] = last - first + 1;
+        lattice.offsets[i] -= first;
+    }
+    return lattice;
+}
+
+//! Input coordinates of the first lattice point
+Vec3 latticeOrigin(const ReconLattice &lattice, const Vec3 &center, double scale) {
+    return center - Vec3(lattice.offsets[0], lattice.offsets[1], lattice.offsets[2]) * (scale / lattice.divs);
+}
+
+void printLattice(const ReconLattice &lattice, const Vec3 &center, double scale) {
+    const Vec3 origin = latticeOrigin(lattice, center, scale);
+    printf("origin: %f, %f, %f\n", origin.x, origin.y, origin.z);
+    printf("center: %f, %f, %f\n", center.x, center.y, center.z);
+    printf("size: %f\n", scale);
+    printf("lattice: %d x %d x %d (voxel: %f)\n", lattice.sizes[0], lattice.sizes[1], lattice.sizes[2],
+           scale / lattice.divs);
+}
+
+//! Scale and translate the vertices in the lattice coordinates back to the input coordinates
+void toInputCoordinates(const ReconLattice &lattice, const Vec3 &center, double scale, std::vector<Vec3> *verts) {
+    const Vec3 origin = latticeOrigin(lattice, center, scale);
+    for (auto &p : *verts) {
+        p = (p / lattice.divs) * scale + origin;
+    }
+}
+
+// Lattice points per edge of the blocks for the narrow-band evaluation
+const int narrowBandBlockSize = 4;
+
+//! Mark the blocks of the lattice which may be within "suppRadius" from any center. Outside them,
+//! the global CS-RBF function is only the linear polynomial term.
+std::vector<uint8_t> markBandBlocks(const std::vector<Vec3> &xyz, double suppRadius, const ReconLattice &lattice) {
+    const int B = narrowBandBlockSize;
+    int nBlocks[3];
+    for (int i = 0; i < 3; i++) {
+        nBlocks[i] = (lattice.sizes[i] + B - 1) / B;
+    }
+    std::vector<uint8_t> band((size_t)nBlocks[0] * nBlocks[1] * nBlocks[2], 0);
+
+    // Block range, where a block also touches the first lattice point of the next block
+    const auto lower = [&](double x, int axis) {
+        return std::max(0, (int)std::floor(lattice.index(x - suppRadius, axis)) / B - 1);
+    };
+    const auto upper = [&](double x, int axis) {
+        return std::min(nBlocks[axis] - 1, (int)std::ceil(lattice.index(x + suppRadius, axis)) / B);
+    };
+
+    for (const auto &x : xyz) {
+        for (int bz = lower(x.z, 2); bz <= upper(x.z, 2); bz++) {
+            for (int by = lower(x.y, 1); by <= upper(x.y, 1); by++) {
+                for (int bx = lower(x.x, 0); bx <= upper(x.x, 0); bx++) {
+                    band[((size_t)bz * nBlocks[1] + by) * nBlocks[0] + bx] = 1;
+                }
+            }
+        }
+    }
+    return band;
+}
+
+//! Narrow-band evaluation of the global CS-RBF function "func(pos, &knn)" at the lattice points. Every block in
+//! "band" is evaluated at all its lattice points. The other blocks are only the linear polynomial term, which is
+//! interpolated exactly from the values at their corners, so the volume is the same as the gather.
+template <typename Func>
+void evaluateNarrowBand(const Func &func, const std::vector<uint8_t> &band, const ReconLattice &lattice,
+                        FloatVolume *volume) {
+    const int B = narrowBandBlockSize;
+    int nBlocks[3], nCorners[3];
+    for (int i = 0; i < 3; i++) {
+        nBlocks[i] = (lattice.sizes[i] + B - 1) / B;
+        nCorners[i] = nBlocks[i] + 1;
+    }
+    const auto cornerIndex = [&](int c, int axis) { return std::min(c * B, lattice.sizes[axis] - 1); };
+    const auto blockId = [&](int bx, int by, int bz) {
+        return ((size_t)bz * nBlocks[1] + by) * nBlocks[0] + bx;
+    };
+
+    // Values at the block corners
+    std::vector<double> corners((size_t)nCorners[0] * nCorners[1] * nCorners[2]);
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int64_t zy = 0; zy < (int64_t)nCorners[2] * nCorners[1]; zy++) {
+        const int cz = (int)(zy / nCorners[1]);
+        const int cy = (int)(zy % nCorners[1]);
+        std::vector<Point> knn;
+        for (int cx = 0; cx < nCorners[0]; cx++) {
+            const Vec3 pos = lattice.position(cornerIndex(cx, 0), cornerIndex(cy, 1), cornerIndex(cz, 2));
+            corners[((size_t)cz * nCorners[1] + cy) * nCorners[0] + cx] = func(pos, &knn);
+        }
+    }
+    const auto corner = [&](int cx, int cy, int cz) {
+        return corners[((size_t)cz * nCorners[1] + cy) * nCorners[0] + cx];
+    };
+
+    const size_t nActive = std::count(band.begin(), band.end(), 1);
+    printf("Narrow band: %zu / %zu blocks\n", nActive, band.size());
+
+    #ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+    #endif
+    for (int64_t zy = 0; zy < (int64_t)nBlocks[2] * nBlocks[1]; zy++) {
+        const int bz = (int)(zy / nBlocks[1]);
+        const int by = (int)(zy % nBlocks[1]);
+        std::vector<Point> knn;
+        for (int bx = 0; bx < nBlocks[0]; bx++) {
+            const int x0 = bx * B, y0 = by * B, z0 = bz * B;
+            const int x1 = std::min(x0 + B, lattice.sizes[0]);
+            const int y1 = std::min(y0 + B, lattice.sizes[1]);
+            const int z1 = std::min(z0 + B, lattice.sizes[2]);
+
+            if (band[blockId(bx, by, bz)]) {
+                for (int k = z0; k < z1; k++) {
+                    for (int j = y0; j < y1; j++) {
+                        for (int i = x0; i < x1; i++) {
+                            (*volume)(i, j, k) = (float)func(lattice.position(i, j, k), &knn);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // Trilinear interpolation of the corners
+            const auto param = [&](int i, int b, int axis) {
+                const int c0 = cornerIndex(b, axis), c1 = cornerIndex(b + 1, axis);
+                return c1 != c0 ? (double)(i - c0) / (c1 - c0) : 0.0;
+            };
+            for (int k = z0; k < z1; k++) {
+                const double w = param(k, bz, 2);
+                for (int j = y0; j < y1; j++) {
+                    const double v = param(j, by, 1);
+                    for (int i = x0; i < x1; i++) {
+                        const double u = param(i, bx, 0);
+                        double value = 0.0;
+                        for (int t = 0; t < 8; t++) {
+                            const int tx = t & 1, ty = (t >> 1) & 1, tz = (t >> 2) & 1;
+                            const double weight = (tx ? u : 1.0 - u) * (ty ? v : 1.0 - v) * (tz ? w : 1.0 - w);
+                            value += weight * corner(bx + tx, by + ty, bz + tz);
+                        }
+                        (*volume)(i, j, k) = (float)value;
+                    }
+                }
+            }
+        }
+    }
+}
+
+//! Evaluate the implicit function, which is either the global CS-RBF function with "weights" or "pu" (if not
+//! null), at the lattice points, and extract its zero level set in the lattice coordinates.
+void extractSurface(const std::vector<Vec3> &xyz, const KDTree<Point> &tree,
+                    const Eigen::Ref<const Eigen::VectorXd> &weights, const PartitionOfUnityRBF *pu,
+                    double suppRadius, const ReconLattice &lattice, GridEvaluation gridEvaluation,
+                    std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces) {
+    const int64_t N = xyz.size();
+
+    // Evaluate values of implicit function at lattice points. The lazy evaluation extracts the surface
+    // while evaluating the function, and leaves the volume empty.
+    const int sizeX = lattice.sizes[0], sizeY = lattice.sizes[1], sizeZ = lattice.sizes[2];
+    FloatVolume volume;
+    if (pu && (gridEvaluation == GridEvaluation::Splat || gridEvaluation == GridEvaluation::NarrowBand)) {
+        fprintf(stderr, "Warning: partition of unity is evaluated at every lattice point (gather)\n");
+    }
+
+    // {{ NOT_IMPL_ERROR();
+    {
+        const auto implicitFunction = [&](const Vec3 &pos, std::vector<Point> *knn) {
+            if (pu) {
+                return pu->value(pos, knn);
+            }
+
+            knn->clear();
+            tree.insideBall(pos, suppRadius, knn);
+
+            double value = 0.0;
+            for (const auto &v : *knn) {
+                value += weights[v.i] * csrbf(pos, v, suppRadius);
+            }
+
+            value += weights(N + 0) * pos.x;
+            value += weights(N + 1) * pos.y;
+            value += weights(N + 2) * pos.z;
+            value += weights(N + 3);
+            return value;
+        };
+
+        if (gridEvaluation == GridEvaluation::Lazy) {
+            const ImplicitFunction latticeFunction = [&](const Vec3 *points, size_t count, float *values) {
+                std::vector<Point> knn;
+                for (size_t i = 0; i < count; i++) {
+                    const Vec3 pos = lattice.position(points[i].x, points[i].y, points[i].z);
+                    values[i] = (float)implicitFunction(pos, &knn);
+                }
+            };
+
+            // Extraction starts from the on-surface constraints inside the lattice
+            std::vector<Vec3> seeds;
+            for (size_t i = 0; i < xyz.size(); i += 3) {
+                const Vec3 seed(lattice.index(xyz[i].x, 0), lattice.index(xyz[i].y, 1), lattice.index(xyz[i].z, 2));
+                if (seed.x >= 0.0 && seed.y >= 0.0 && seed.z >= 0.0 && seed.x <= sizeX - 1.0 &&
+                    seed.y <= sizeY - 1.0 && seed.z <= sizeZ - 1.0) {
+                    seeds.push_back(seed);
+                }
+            }
+            const std::array<uint64_t, 3> sizes = { (uint64_t)sizeX, (uint64_t)sizeY, (uint64_t)sizeZ };
+            marchCubes(latticeFunction, sizes, seeds, outVerts, outFaces, 0.0);
+        } else if (!pu && gridEvaluation == GridEvaluation::NarrowBand) {
+            volume = FloatVolume(sizeX, sizeY, sizeZ);
+            const std::vector<uint8_t> band = markBandBlocks(xyz, suppRadius, lattice);
+            evaluateNarrowBand(implicitFunction, band, lattice, &volume);
+        } else if (!pu && gridEvaluation == GridEvaluation::Splat) {
+            volume = FloatVolume(sizeX, sizeY, sizeZ);
+            splatImplicitFunction(xyz, weights, suppRadius, lattice, &volume);
+        } else {
+            volume = FloatVolume(sizeX, sizeY, sizeZ);
+            ProgressBar pbar(sizeX);
+            for (int i = 0; i < sizeX; i++) {
+                #ifdef _OPENMP
+                #pragma omp parallel for
+                #endif
+                for (int j = 0; j < sizeY; j++) {
+                    std::vector<Point> knn;
+                    for (int k = 0; k < sizeZ; k++) {
+                        const Point pos(lattice.position(i, j, k));
+                        volume(i, j, k) = (float)implicitFunction(pos, &knn);
+                    }
+                }
+                pbar.step();
+            }
+        }
+    }
+    // }}
+
+    // Marching cubes to get iso-contour, where the implicit function is passed as it is
+    if (gridEvaluation != GridEvaluation::Lazy) {
+        marchCubes(volume, outVerts, outFaces, 0.0);
+    }
+}
+
 void surfaceFromPoints(const std::vector<Vec3> &positions, const std::vector<Vec3> &normals,
                        std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
-                       double suppRadius, int mcubeDivs) {
+                       const SurfaceReconOptions &options) {
+    const double suppRadius = options.suppRadius;
+    const RBFSystemStorage storage = options.storage;
 
     // In this program, point cloud is first scaled and translated to be inside [-0.5, 0.5]^3 regular cube.
     // This prevents to adjust parameters for CS-RBF or off-surface positions.
@@ -64,12 +570,12 @@ void surfaceFromPoints(const std::vector<Vec3> &positions, const std::vector<Vec
         maxZ = std::max(maxZ, positions[i].z);
     }
 
-    const double maxExtent = std::max(maxX - minX, std::max(maxY - minY, maxZ - minZ)) * 1.1;
+    const double extents[3] = { maxX - minX, maxY - minY, maxZ - minZ };
+    const double maxExtent = std::max(extents[0], std::max(extents[1], extents[2])) * 1.1;
     const Vec3 center = Vec3(minX + maxX, minY + maxY, minZ + maxZ) * 0.5;
-    const Vec3 origin = center - Vec3(maxExtent) * 0.5;
-    printf("origin: %f, %f, %f\n", origin.x, origin.y, origin.z);
-    printf("center: %f, %f, %f\n", center.x, center.y, center.z);
-    printf("size: %f\n", maxExtent);
+
+    const ReconLattice lattice = fitLattice(extents, center, maxExtent, options);
+    printLattice(lattice, center, maxExtent);
 
     // Normalize input data and construct KD tree.
     KDTree<Point> tree;
@@ -89,41 +595,52 @@ void surfaceFromPoints(const std::vector<Vec3> &positions, const std::vector<Vec
         }
         tree.construct(points);
 
-        double dist;
-        Point query, near;
-
+        // Each input point gives three constraints at (3 * i, 3 * i + 1, 3 * i + 2),
+        // so that they are generated independently in the same order as the input.
+        xyz.resize(3 * nPoints);
+        fvals.resize(3 * nPoints);
 
         const double jitter = suppRadius * 0.5;
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static)
+        #endif
         for (int i = 0; i < nPoints; i++) {
             const auto p = Vec3(points[i]);
             const auto n = normals[points[i].i];
 
             // On-surface
-            xyz.push_back(p);
-            fvals.push_back(0.0);
+            xyz[3 * i + 0] = p;
+            fvals[3 * i + 0] = 0.0;
 
             // Off-surface (outside)
-            query = p + n * jitter;
-            near = tree.nearest(query);
-            dist = dot(query - near, normals[near.i]) / jitter;
-            xyz.push_back(query);
-            fvals.push_back(dist);
+            Point query = p + n * jitter;
+            Point near = tree.nearest(query);
+            xyz[3 * i + 1] = query;
+            fvals[3 * i + 1] = dot(query - near, normals[near.i]) / jitter;
 
             // Off-surface (inside)
             query = p - n * jitter;
             near = tree.nearest(query);
-            dist = dot(query - near, normals[near.i]) / jitter;
-            xyz.push_back(query);
-            fvals.push_back(dist);
+            xyz[3 * i + 2] = query;
+            fvals[3 * i + 2] = dot(query - near, normals[near.i]) / jitter;
         }
     }
     // }}
 
+    // Linear solver (direct one for the small local systems of partition of unity)
+    RBFSolver *solver = options.solver;
+    std::unique_ptr<RBFSolver> defaultSolver;
+    if (!solver) {
+        defaultSolver = createRBFSolver(options.partitionOfUnity ? RBFSolverType::SchurLDLT : RBFSolverType::BiCGSTAB);
+        solver = defaultSolver.get();
+    }
+
     // Construct a sparse linear system
     const int64_t N = xyz.size();
     SparseMatrix AA(N + 4, N + 4);
-    Eigen::VectorXd bb(N + 4);
-    std::vector<Triplet> triplets;
+    std::unique_ptr<CSRBFOperator> op;
+    std::unique_ptr<PartitionOfUnityRBF> pu;
+    Eigen::VectorXd bb = Eigen::VectorXd::Zero(N + 4);
 
     // {{ NOT_IMPL_ERROR();
     {
@@ -135,90 +652,174 @@ void surfaceFromPoints(const std::vector<Vec3> &positions, const std::vector<Vec
         tree.construct(points);
 
         for (int64_t i = 0; i < N; i++) {
-            std::vector<Point> knn;
-            tree.insideBall(xyz[i], suppRadius, &knn);
-
-            for (const auto &v : knn) {
-                const double phi = csrbf(xyz[i], v, suppRadius);
-                triplets.emplace_back(i, v.i, phi);
-            }
-
             bb(i) = fvals[i];
         }
 
-        for (int64_t i = 0; i < N; i++) {
-            const auto &v = xyz[i];
-            double pos[4] = {v.x, v.y, v.z, 1.0};
-            for (int64_t j = 0; j < 4; j++) {
-                triplets.emplace_back(i, N + j, pos[j]);
-                triplets.emplace_back(N + j, i, pos[j]);
-            }
-        }
-    }
-    // }}
-    AA.setFromTriplets(triplets.begin(), triplets.end());
-
-    // Solve sparse linear system
-    printf("Solving linear system...\n");
-    printf("  non-zeros: %d\n", (int)AA.nonZeros());
-    printf("   mat-size: %d x %d\n", (int)AA.rows(), (int)AA.cols());
-
-    Eigen::BiCGSTAB<SparseMatrix> solver;
-    solver.setMaxIterations(500);
-    solver.setTolerance(1.0e-12);
-    solver.compute(AA);
-    const Eigen::VectorXd weights = solver.solve(bb);
-
-    printf("Finish!\n");
-    printf("#iterations: %zu\n", solver.iterations());
-    printf("#error: %f\n", solver.error());
+        if (options.partitionOfUnity) {
+            pu.reset(new PartitionOfUnityRBF(xyz, fvals, tree, suppRadius, *solver, options.puCellCapacity,
+                                             options.puOverlap));
+        } else if (storage != RBFSystemStorage::Assembled) {
+            op.reset(new CSRBFOperator(xyz, tree, suppRadius, storage == RBFSystemStorage::NeighborList));
+        } else {
+            // The compressed storage is filled directly. As the kernel is symmetric, the neighbors of
+            // the i-th point form the i-th column. Columns are gathered in fixed-size chunks, which are
+            // copied in order after the prefix sum, so the matrix does not depend on the thread count.
+            const int64_t chunkSize = 4096;
+            const int64_t nChunks = (N + chunkSize - 1) / chunkSize;
+            std::vector<std::vector<IndexType>> chunkRows(nChunks);
+            std::vector<std::vector<FloatType>> chunkValues(nChunks);
+            IndexType *outer = AA.outerIndexPtr();
 
-    // Evaluate values of implicit function at lattice points
-    const int div = mcubeDivs;
-    Volume volume(div, div, div);
-
-    // {{ NOT_IMPL_ERROR();
-    {
-        ProgressBar pbar(div);
-        for (int i = 0; i < div; i++) {
             #ifdef _OPENMP
-            #pragma omp parallel for
+            #pragma omp parallel for schedule(dynamic)
             #endif
-            for (int j = 0; j < div; j++) {
-                for (int k = 0; k < div; k++) {
-                    const double px = (i - (div * 0.5)) / div;
-                    const double py = (j - (div * 0.5)) / div;
-                    const double pz = (k - (div * 0.5)) / div;
-                    const Point pos(Vec3(px, py, pz));
+            for (int64_t c = 0; c < nChunks; c++) {
+                std::vector<IndexType> &rows = chunkRows[c];
+                std::vector<FloatType> &values = chunkValues[c];
+                std::vector<Point> knn;
+                const int64_t end = std::min(N, (c + 1) * chunkSize);
+                for (int64_t i = c * chunkSize; i < end; i++) {
+                    knn.clear();
+                    tree.insideBall(xyz[i], suppRadius, &knn);
+                    std::sort(knn.begin(), knn.end(), [](const Point &p, const Point &q) { return p.i < q.i; });
 
-                    std::vector<Point> knn;
-                    tree.insideBall(pos, suppRadius, &knn);
-
-                    double value = 0.0;
                     for (const auto &v : knn) {
-                        value += weights[v.i] * csrbf(pos, v, suppRadius);
+                        rows.push_back(v.i);
+                        values.push_back(csrbf(xyz[i], v, suppRadius));
                     }
 
-                    value += weights(N + 0) * pos.x;
-                    value += weights(N + 1) * pos.y;
-                    value += weights(N + 2) * pos.z;
-                    value += weights(N + 3);
+                    // Linear polynomial terms
+                    const double pos[4] = {xyz[i].x, xyz[i].y, xyz[i].z, 1.0};
+                    for (int64_t j = 0; j < 4; j++) {
+                        rows.push_back(N + j);
+                        values.push_back(pos[j]);
+                    }
 
-                    value = std::max(-1.0, std::min(value, 1.0));
-                    value = (value + 1.0) * 0.5;
-                    volume(i, j, k) = (int) (value * USHRT_MAX);
+                    outer[i + 1] = (IndexType)knn.size() + 4;
+                }
+            }
+
+            for (int64_t j = 0; j < 4; j++) {
+                outer[N + j + 1] = N;
+            }
+            for (int64_t i = 0; i < N + 4; i++) {
+                outer[i + 1] += outer[i];
+            }
+            AA.resizeNonZeros(outer[N + 4]);
+
+            IndexType *inner = AA.innerIndexPtr();
+            FloatType *data = AA.valuePtr();
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(static)
+            #endif
+            for (int64_t c = 0; c < nChunks; c++) {
+                const IndexType offset = outer[c * chunkSize];
+                std::copy(chunkRows[c].begin(), chunkRows[c].end(), inner + offset);
+                std::copy(chunkValues[c].begin(), chunkValues[c].end(), data + offset);
+                std::vector<IndexType>().swap(chunkRows[c]);
+                std::vector<FloatType>().swap(chunkValues[c]);
+            }
+
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(static)
+            #endif
+            for (int64_t i = 0; i < N; i++) {
+                const double pos[4] = {xyz[i].x, xyz[i].y, xyz[i].z, 1.0};
+                for (int64_t j = 0; j < 4; j++) {
+                    inner[outer[N + j] + i] = i;
+                    data[outer[N + j] + i] = pos[j];
                 }
             }
-            pbar.step();
         }
     }
     // }}
 
-    // Marching cubes to get iso-contour
-    marchCubes(volume, outVerts, outFaces, 0.5);
+    // Solve sparse linear system
+    Eigen::VectorXd weights;
+    bool converged = true;
+    if (!pu) {
+        printf("Solving linear system...\n");
+        if (op) {
+            printf("matrix-free: %.1f MB\n", op->memoryBytes() / (1024.0 * 1024.0));
+        } else {
+            printf("  non-zeros: %d\n", (int)AA.nonZeros());
+        }
+        printf("   mat-size: %d x %d\n", (int)AA.rows(), (int)AA.cols());
+
+        if (!options.warmStartFile.empty()) {
+            const RBFModel previous(options.warmStartFile);
+            if (previous.numCenters() == N) {
+                solver->setWarmStart(true);
+                solver->setInitialGuess(previous.weights());
+                printf(" warm start: %s\n", options.warmStartFile.c_str());
+            } else {
+                fprintf(stderr, "Warning: %s does not match the constraints (%lld centers)\n",
+                        options.warmStartFile.c_str(), (long long)previous.numCenters());
+            }
+        }
+
+        const RBFSolverReport report = op ? solver->solve(*op, bb, &weights) : solver->solve(AA, bb, &weights);
+
+        printf("Finish!\n");
+        printf("     solver: %s\n", report.method);
+        printf("       time: %.3f sec\n", report.seconds);
+        printf("#iterations: %lld\n", (long long)report.iterations);
+        printf("  #residual: %e\n", report.residual);
+        if (!report.success) {
+            fprintf(stderr, "Warning: %s did not converge (residual: %e)\n", report.method, report.residual);
+        }
+        converged = report.success;
+    }
+
+    // Save the global function to re-mesh it later (the local functions of partition of unity are not saved)
+    if (!options.modelFile.empty()) {
+        if (pu) {
+            fprintf(stderr, "Warning: partition of unity cannot be saved to %s\n", options.modelFile.c_str());
+        } else if (!converged) {
+            fprintf(stderr, "Warning: the unconverged function is not saved to %s\n", options.modelFile.c_str());
+        } else {
+            RBFModel::save(options.modelFile, xyz, weights, suppRadius, center, maxExtent, extents);
+            printf("Model: %s\n", options.modelFile.c_str());
+        }
+    }
+
+    extractSurface(xyz, tree, weights, pu.get(), suppRadius, lattice, options.gridEvaluation, outVerts, outFaces);
 
     // Scale and translate back to original domain
-    for (auto &p : *outVerts) {
-        p = (p / div) * maxExtent + origin;
+    toInputCoordinates(lattice, center, maxExtent, outVerts);
+}
+
+void surfaceFromModel(const std::string &filename, std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
+                      const SurfaceReconOptions &options) {
+    // The weights are used in place from the mapped file, and only the KD tree of the centers is rebuilt
+    const RBFModel model(filename);
+    const RBFModel::Header &info = model.info();
+    printf("#center: %lld\n", (long long)model.numCenters());
+    printf("support radius: %f\n", info.suppRadius);
+
+    std::vector<Vec3> xyz(model.numCenters());
+    std::vector<Point> points;
+    for (int64_t i = 0; i < model.numCenters(); i++) {
+        xyz[i] = model.centerAt(i);
+        points.emplace_back(xyz[i], i);
     }
-}
\ No newline at end of file
+    KDTree<Point> tree;
+    tree.construct(points);
+
+    const Vec3 center(info.center[0], info.center[1], info.center[2]);
+    const ReconLattice lattice = fitLattice(info.extents, center, info.scale, options);
+    printLattice(lattice, center, info.scale);
+
+    extractSurface(xyz, tree, model.weights(), nullptr, info.suppRadius, lattice, options.gridEvaluation, outVerts,
+                   outFaces);
+    toInputCoordinates(lattice, center, info.scale, outVerts);
+}
+
+void surfaceFromPoints(const std::vector<Vec3> &positions, const std::vector<Vec3> &normals,
+                       std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
+                       double suppRadius, int mcubeDivs) {
+    SurfaceReconOptions options;
+    options.suppRadius = suppRadius;
+    options.mcubeDivs = mcubeDivs;
+    surfaceFromPoints(positions, normals, outVerts, outFaces, options);
+}
@@ -1,8 +1,71 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include "common/vec3.h"
 
+class RBFSolver;
+
+//! Representation of the CS-RBF system
+enum class RBFSystemStorage {
+    Assembled = 0x00,     //!< Sparse matrix (16 bytes per non-zero)
+    NeighborList = 0x01,  //!< Matrix-free with the cached neighbor indices (4 bytes per non-zero)
+    OnTheFly = 0x02,      //!< Matrix-free with the neighbors searched at every product
+};
+
+//! Evaluation of the implicit function at the lattice points
+enum class GridEvaluation {
+    Gather = 0x00,      //!< Search the centers around each lattice point
+    Splat = 0x01,       //!< Scatter the kernel of each center into the lattice points around it
+    NarrowBand = 0x02,  //!< Evaluate only the blocks of the lattice within the support of the centers
+    Lazy = 0x03,        //!< Extract the surface from the input points without the volume (see "marchCubes")
+};
+
+struct SurfaceReconOptions {
+    double suppRadius = 0.05;  //!< Support radius of CS-RBF in the normalized cube
+    int mcubeDivs = 256;       //!< Resolution of the lattice for marching cubes along the largest extent
+
+    //! Edge length of the voxels in the input coordinates, which is used instead of "mcubeDivs" if positive.
+    //! In either case, the voxels are cubes, and the lattice is fit to the extent of the points along each axis.
+    double voxelSize = 0.0;
+
+    //! Linear solver. If null, BiCGSTAB is used for the global system, and the direct SchurLDLT
+    //! for the local systems of partition of unity.
+    RBFSolver *solver = nullptr;
+    RBFSystemStorage storage = RBFSystemStorage::Assembled;
+
+    //! Splatting and the narrow band are used only for the global system, and partition of unity falls back to
+    //! the gather
+    GridEvaluation gridEvaluation = GridEvaluation::Gather;
+
+    //! Partition of unity, which solves a local system for each octree leaf with at most "puCellCapacity"
+    //! constraints, instead of the global system ("storage" is not used).
+    bool partitionOfUnity = false;
+    int puCellCapacity = 150;
+    double puOverlap = 1.1;
+
+    //! If not empty, the solved global CS-RBF function is saved to this file (see "surfaceFromModel") unless
+    //! the solver did not converge
+    std::string modelFile;
+
+    //! If not empty, the global system is solved with warm start from the weights of this model file, e.g.,
+    //! saved before the points are slightly changed. It is ignored if the number of constraints differs.
+    std::string warmStartFile;
+
+    //! Region to reconstruct in the input coordinates, which is clipped to the bounding box of the points
+    Vec3 regionMin = Vec3(-1.0e20);
+    Vec3 regionMax = Vec3(1.0e20);
+};
+
 void surfaceFromPoints(const std::vector<Vec3> &points, const std::vector<Vec3> &normals,
                        std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
-                       double supRadius = 0.05, int mcubeDivs = 256);
\ No newline at end of file
+                       const SurfaceReconOptions &options);
+
+void surfaceFromPoints(const std::vector<Vec3> &points, const std::vector<Vec3> &normals,
+                       std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
+                       double supRadius = 0.05, int mcubeDivs = 256);
+
+//! Extract the surface of the CS-RBF function saved by "surfaceFromPoints" (see "modelFile") without solving
+//! the system again. Only the options of the lattice, the region and the grid evaluation are used.
+void surfaceFromModel(const std::string &filename, std::vector<Vec3> *outVerts, std::vector<uint32_t> *outFaces,
+                      const SurfaceReconOptions &options);